@@ -19,6 +19,9 @@ LIB_DIRS = [
 
 dir_config('libprotobuf-c', HEADER_DIRS, LIB_DIRS)
 dir_config('zlib', HEADER_DIRS, LIB_DIRS)
+dir_config('libdeflate', HEADER_DIRS, LIB_DIRS)
+dir_config('lzma', HEADER_DIRS, LIB_DIRS)
+dir_config('zstd', HEADER_DIRS, LIB_DIRS)
 
 abort "protobuf-c is required" unless find_header('protobuf-c/protobuf-c.h')
 abort "zlib is required"       unless find_header('zlib.h')
@@ -26,4 +29,30 @@ abort "zlib is required"       unless find_header('zlib.h')
 abort "protobuf-c is required" unless find_library('protobuf-c', 'protobuf_c_message_unpack')
 abort "zlib is required"       unless find_library('z', 'inflate')
 
+# Optional faster whole-buffer inflate, disable with --without-libdeflate
+if with_config('libdeflate', true) && have_library('deflate', 'libdeflate_zlib_decompress', 'libdeflate.h')
+  $defs << '-DHAVE_LIBDEFLATE'
+end
+
+# Optional blob compressions, disable with --without-lzma / --without-zstd
+if with_config('lzma', true) && have_library('lzma', 'lzma_auto_decoder', 'lzma.h')
+  $defs << '-DHAVE_LZMA'
+end
+
+if with_config('zstd', true) && have_library('zstd', 'ZSTD_decompressDCtx', 'zstd.h')
+  $defs << '-DHAVE_ZSTD'
+end
+
+# Deduplicated frozen strings for the string table (Ruby 3.0+)
+have_func('rb_enc_interned_str', 'ruby/encoding.h')
+
+# Optional memory-mapped input
+have_func('madvise', 'sys/mman.h') if have_header('sys/mman.h')
+
+# Parallel decoding needs native threads, positioned reads and a way to release the GVL
+have_header('pthread.h')
+have_func('pread', 'unistd.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_nogvl', 'ruby/thread.h')
+
 create_makefile('pbf_parser/pbf_parser')
@@ -93,7 +93,7 @@ void   osmpbf__blob_header__free_unpacked
   assert(message->base.descriptor == &osmpbf__blob_header__descriptor);
   protobuf_c_message_free_unpacked ((ProtobufCMessage*)message, allocator);
 }
-static const ProtobufCFieldDescriptor osmpbf__blob__field_descriptors[5] =
+static const ProtobufCFieldDescriptor osmpbf__blob__field_descriptors[7] =
 {
   {
     "raw",
@@ -155,18 +155,44 @@ static const ProtobufCFieldDescriptor osmpbf__blob__field_descriptors[5] =
     0 | PROTOBUF_C_FIELD_FLAG_DEPRECATED,             /* flags */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "lz4_data",
+    6,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_BYTES,
+    offsetof(OSMPBF__Blob, has_lz4_data),
+    offsetof(OSMPBF__Blob, lz4_data),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
+  {
+    "zstd_data",
+    7,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_BYTES,
+    offsetof(OSMPBF__Blob, has_zstd_data),
+    offsetof(OSMPBF__Blob, zstd_data),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned osmpbf__blob__field_indices_by_name[] = {
   4,   /* field[4] = OBSOLETE_bzip2_data */
+  5,   /* field[5] = lz4_data */
   3,   /* field[3] = lzma_data */
   0,   /* field[0] = raw */
   1,   /* field[1] = raw_size */
   2,   /* field[2] = zlib_data */
+  6,   /* field[6] = zstd_data */
 };
 static const ProtobufCIntRange osmpbf__blob__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 5 }
+  { 0, 7 }
 };
 const ProtobufCMessageDescriptor osmpbf__blob__descriptor =
 {
@@ -176,7 +202,7 @@ const ProtobufCMessageDescriptor osmpbf__blob__descriptor =
   "OSMPBF__Blob",
   "OSMPBF",
   sizeof(OSMPBF__Blob),
-  5,
+  7,
   osmpbf__blob__field_descriptors,
   osmpbf__blob__field_indices_by_name,
   1,  osmpbf__blob__number_ranges,
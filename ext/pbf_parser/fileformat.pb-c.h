@@ -37,10 +37,14 @@ struct  _OSMPBF__Blob
   ProtobufCBinaryData lzma_data;
   protobuf_c_boolean has_obsolete_bzip2_data PROTOBUF_C__DEPRECATED;
   ProtobufCBinaryData obsolete_bzip2_data PROTOBUF_C__DEPRECATED;
+  protobuf_c_boolean has_lz4_data;
+  ProtobufCBinaryData lz4_data;
+  protobuf_c_boolean has_zstd_data;
+  ProtobufCBinaryData zstd_data;
 };
 #define OSMPBF__BLOB__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&osmpbf__blob__descriptor) \
-    , 0,{0,NULL}, 0,0, 0,{0,NULL}, 0,{0,NULL}, 0,{0,NULL} }
+    , 0,{0,NULL}, 0,0, 0,{0,NULL}, 0,{0,NULL}, 0,{0,NULL}, 0,{0,NULL}, 0,{0,NULL} }
 
 
 struct  _OSMPBF__BlobHeader
@@ -1,5 +1,21 @@
 #include "pbf_parser.h"
 
+// Hash keys of the entities, resolved once by Init_pbf_parser
+static VALUE sym_id, sym_lat, sym_lon, sym_version, sym_timestamp, sym_changeset, sym_uid, sym_user;
+static VALUE sym_tags, sym_refs, sym_members, sym_role, sym_nodes, sym_ways, sym_relations;
+static VALUE sym_ids, sym_types, sym_roles, sym_role_names;
+static VALUE sym_node, sym_way, sym_relation;
+static VALUE sym_size, sym_tag_offsets, sym_tag_keys, sym_tag_values, sym_threads;
+static VALUE sym_top, sym_right, sym_bottom, sym_left, sym_bbox, sym_timestamps;
+static VALUE sym_header_pos, sym_header_size, sym_data_pos, sym_data_size;
+static VALUE sym_buffer_peak, sym_arena_peak, sym_arena_size;
+static VALUE sym_string_cache_size, sym_string_cache_hits, sym_string_cache_misses;
+
+static VALUE packed_ids_class;
+static VALUE lazy_entities_class, lazy_entity_class;
+static VALUE node_class, way_class, relation_class;
+static ID id_node, id_way, id_relation, id_key_p;
+
 /*
   Set string encoding to UTF8
   See http://tenderlovemaking.com/2009/06/26/string-encoding-in-ruby-1-9-c-extensions.html
@@ -15,754 +31,4712 @@ static VALUE str_new(const char *str) {
   return string;
 }
 
-static size_t get_header_size(FILE *input)
+// Frozen UTF-8 string, deduplicated with equal strings where Ruby allows it
+static VALUE str_intern(ProtobufCBinaryData bstr)
 {
-  char buffer[4];
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str((const char *)bstr.data, bstr.len, rb_utf8_encoding());
+#else
+  VALUE string = rb_str_new((const char *)bstr.data, bstr.len);
 
-  if(fread(buffer, sizeof(buffer), 1, input) != 1)
-    return 0;
+  #ifdef HAVE_RUBY_ENCODING_H
+  rb_enc_associate(string, rb_utf8_encoding());
+  #endif
+
+  return rb_obj_freeze(string);
+#endif
+}
+
+static void *buffer_reserve(pbf_buffer_t *buffer, size_t size)
+{
+  if(size > buffer->size)
+  {
+    // Grow straight to the requested size, blobs rarely get much bigger
+    void *data = realloc(buffer->data, size);
+
+    if(!data)
+      return NULL;
+
+    buffer->data = data;
+    buffer->size = size;
+  }
 
-  return ntohl(*((size_t *)buffer));
+  return buffer->data;
 }
 
-static char *parse_binary_str(ProtobufCBinaryData bstr)
+static void buffer_free(pbf_buffer_t *buffer)
 {
-  char *str = calloc(bstr.len + 1, 1);
-  memcpy(str, bstr.data, bstr.len);
+  free(buffer->data);
 
-  return str;
+  buffer->data = NULL;
+  buffer->size = 0;
 }
 
-static OSMPBF__BlobHeader *read_blob_header(FILE *input)
+static pbf_arena_chunk_t *arena_chunk_new(pbf_arena_t *arena, size_t size)
 {
-  void *buffer;
-  size_t length = get_header_size(input);
-  OSMPBF__BlobHeader *header = NULL;
+  pbf_arena_chunk_t *chunk = malloc(ARENA_ALIGN(sizeof(pbf_arena_chunk_t)) + size);
 
-  if(length < 1 || length > MAX_BLOB_HEADER_SIZE)
+  if(!chunk)
+    return NULL;
+
+  chunk->next = arena->chunks;
+  chunk->size = size;
+  chunk->used = 0;
+
+  arena->chunks    = chunk;
+  arena->capacity += size;
+
+  return chunk;
+}
+
+// Must not raise: protobuf-c expects NULL when memory runs out
+static void *arena_alloc(void *allocator_data, size_t size)
+{
+  pbf_arena_t *arena = allocator_data;
+  pbf_arena_chunk_t *chunk = arena->chunks;
+  void *ptr;
+
+  size = ARENA_ALIGN(size);
+
+  if(!chunk || size > chunk->size - chunk->used)
   {
-    if(feof(input))
+    if(!(chunk = arena_chunk_new(arena, size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE)))
       return NULL;
-    else
-      rb_raise(rb_eIOError, "Invalid blob header size");
   }
 
-  if(!(buffer = malloc(length)))
-    rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob header");
+  ptr = (char *)chunk + ARENA_ALIGN(sizeof(pbf_arena_chunk_t)) + chunk->used;
+
+  chunk->used += size;
+  arena->used += size;
+
+  return ptr;
+}
+
+// Memory is only given back by arena_reset
+static void arena_free(void *allocator_data, void *ptr)
+{
+}
+
+static void arena_init(pbf_arena_t *arena)
+{
+  arena->allocator.alloc          = arena_alloc;
+  arena->allocator.free           = arena_free;
+  arena->allocator.allocator_data = arena;
+}
+
+static void arena_release(pbf_arena_t *arena)
+{
+  pbf_arena_chunk_t *chunk = arena->chunks, *next;
 
-  if(!fread(buffer, length, 1, input))
+  while(chunk)
   {
-    free(buffer);
-    rb_raise(rb_eIOError, "Unable to read the blob header");
+    next = chunk->next;
+    free(chunk);
+    chunk = next;
   }
 
-  header = osmpbf__blob_header__unpack(NULL, length, buffer);
+  arena->chunks   = NULL;
+  arena->capacity = 0;
+}
 
-  free(buffer);
+/*
+  Drop everything allocated since the last reset. When the last block needed
+  more than one chunk they are merged into a single one, so a run of similar
+  blocks settles on one allocation.
+*/
+static void arena_reset(pbf_arena_t *arena)
+{
+  if(arena->used > arena->peak)
+    arena->peak = arena->used;
 
-  if(header == NULL)
-    rb_raise(rb_eIOError, "Unable to unpack the blob header");
+  arena->used = 0;
 
-  return header;
+  if(arena->chunks && arena->chunks->next)
+  {
+    size_t capacity = arena->capacity;
+
+    arena_release(arena);
+    arena_chunk_new(arena, capacity);
+  }
+  else if(arena->chunks)
+    arena->chunks->used = 0;
 }
 
-static void *read_blob(FILE *input, size_t length, size_t *raw_length)
+// Hand the memory of `from` over to `to`, leaving `from` empty
+static void arena_move(pbf_arena_t *from, pbf_arena_t *to)
 {
-  VALUE exc = Qnil;
-  void *buffer = NULL;
-  OSMPBF__Blob *blob = NULL;
+  if(from->used > from->peak)
+    from->peak = from->used;
 
-  if(length < 1 || length > MAX_BLOB_SIZE)
-    rb_raise(rb_eIOError, "Invalid blob size");
+  if(from->used > to->peak)
+    to->peak = from->used;
 
-  if(!(buffer = malloc(length)))
-    rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob");
+  arena_init(to);
 
-  if(fread(buffer, length, 1, input))
-    blob = osmpbf__blob__unpack(NULL, length, buffer);
+  to->chunks   = from->chunks;
+  to->used     = from->used;
+  to->capacity = from->capacity;
 
-  free(buffer);
+  from->chunks   = NULL;
+  from->used     = 0;
+  from->capacity = 0;
+}
 
-  if(blob == NULL)
-    rb_raise(rb_eIOError, "Unable to read the blob");
+static void decoder_init(pbf_decoder_t *decoder)
+{
+  arena_init(&decoder->arena);
+  arena_init(&decoder->scratch);
+}
 
-  void *data = NULL;
+static void decoder_free(pbf_decoder_t *decoder)
+{
+  buffer_free(&decoder->compressed);
+  buffer_free(&decoder->raw);
+  arena_release(&decoder->arena);
+  arena_release(&decoder->scratch);
 
-  if(blob->has_raw)
-  {
-    if(!(data = malloc(blob->raw.len)))
-    {
-      exc = rb_exc_new2(rb_eNoMemError, "Unable to allocate memory for the data");
-      goto exit_nicely;
-    }
+  if(decoder->strm_ready)
+    (void)inflateEnd(&decoder->strm);
 
-    memcpy(data, blob->raw.data, blob->raw.len);
-    *raw_length = blob->raw.len;
-  }
-  else if(blob->has_zlib_data)
-  {
-    if(!(data = malloc(MAX_BLOB_SIZE)))
-    {
-      exc = rb_exc_new2(rb_eNoMemError, "Unable to allocate memory for the data");
-      goto exit_nicely;
-    }
+  decoder->strm_ready = 0;
 
-    int ret;
-    z_stream strm;
+#ifdef HAVE_LIBDEFLATE
+  if(decoder->deflate)
+    libdeflate_free_decompressor(decoder->deflate);
 
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = (unsigned int)blob->zlib_data.len;
-    strm.next_in = blob->zlib_data.data;
-    strm.avail_out = blob->raw_size;
-    strm.next_out = data;
+  decoder->deflate = NULL;
+#endif
 
-    ret = inflateInit(&strm);
+#ifdef HAVE_LZMA
+  if(decoder->lzma_ready)
+    lzma_end(&decoder->lzma);
 
-    if (ret != Z_OK)
-    {
-      exc = rb_exc_new2(rb_eRuntimeError, "Zlib init failed");
-      goto exit_nicely;
-    }
+  decoder->lzma_ready = 0;
+#endif
 
-    ret = inflate(&strm, Z_NO_FLUSH);
+#ifdef HAVE_ZSTD
+  if(decoder->zstd)
+    ZSTD_freeDCtx(decoder->zstd);
 
-    (void)inflateEnd(&strm);
+  decoder->zstd = NULL;
+#endif
+}
 
-    if (ret != Z_STREAM_END)
-    {
-      exc = rb_exc_new2(rb_eRuntimeError, "Zlib compression failed");
-      goto exit_nicely;
-    }
+// Record an error so it can be raised once the GVL is held again
+static void *decoder_fail(pbf_decoder_t *decoder, VALUE *error_class, const char *error)
+{
+  decoder->error_class = error_class;
+  decoder->error = error;
+
+  return NULL;
+}
+
+static void decoder_raise(pbf_decoder_t *decoder)
+{
+  const char *error = decoder->error;
+
+  if(!error)
+    return;
+
+  decoder->error = NULL;
+  rb_raise(*decoder->error_class, "%s", error);
+}
+
+#ifndef HAVE_LIBDEFLATE
+/*
+  The z_stream is set up for the first zlib blob and then only reset, which
+  keeps zlib's state and window allocated across blobs.
+*/
+static int decoder_inflate_reset(pbf_decoder_t *decoder)
+{
+  z_stream *strm = &decoder->strm;
+
+  if(decoder->strm_ready && inflateReset(strm) == Z_OK)
+    return Z_OK;
+
+  if(decoder->strm_ready)
+    (void)inflateEnd(strm);
+
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
+  strm->avail_in = 0;
+  strm->next_in = Z_NULL;
+
+  decoder->strm_ready = inflateInit(strm) == Z_OK;
+
+  return decoder->strm_ready ? Z_OK : Z_MEM_ERROR;
+}
+#endif
+
+static int input_open_mmap(pbf_input_t *input, const char *filename)
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  void *map;
+  int fd = open(filename, O_RDONLY);
+
+  if(fd < 0)
+    return 0;
 
-    *raw_length = blob->raw_size;
+  if(fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    close(fd);
+    return 0;
   }
-  else if(blob->has_lzma_data)
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+
+  if(map == MAP_FAILED)
+    return 0;
+
+  #ifdef HAVE_MADVISE
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+  #endif
+
+  input->map      = map;
+  input->map_size = (size_t)st.st_size;
+  input->map_pos  = 0;
+
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+static int input_open(pbf_input_t *input, const char *filename, int use_mmap)
+{
+  if(use_mmap && input_open_mmap(input, filename))
+    return 1;
+
+  // Fall back to stdio
+  return (input->file = fopen(filename, "rb")) != NULL;
+}
+
+static void input_close(pbf_input_t *input)
+{
+#ifdef HAVE_SYS_MMAN_H
+  if(input->map)
+    munmap(input->map, input->map_size);
+#endif
+
+  if(input->file)
+    fclose(input->file);
+
+  input->map  = NULL;
+  input->file = NULL;
+}
+
+/*
+  Read `length` bytes from the input. The returned pointer points either into
+  the mapping or into `buffer`, so it is only valid until `buffer` is reused.
+*/
+static const void *input_read(pbf_input_t *input, pbf_buffer_t *buffer, size_t length)
+{
+  if(input->map)
   {
-    exc = rb_exc_new2(rb_eNotImpError, "LZMA compression is not supported");
-    goto exit_nicely;
+    const void *data;
+
+    if(length > input->map_size - input->map_pos)
+      return NULL;
+
+    data = input->map + input->map_pos;
+    input->map_pos += length;
+
+    return data;
   }
-  else
+
+  if(!buffer_reserve(buffer, length))
+    return NULL;
+
+  if(fread(buffer->data, length, 1, input->file) != 1)
+    return NULL;
+
+  return buffer->data;
+}
+
+#ifdef PBF_USE_THREADS
+/*
+  Read `length` bytes at `offset` without moving the input position, so it can
+  be used from several threads at once as long as each has its own buffer.
+*/
+static const void *input_read_at(pbf_input_t *input, pbf_buffer_t *buffer, long offset, size_t length)
+{
+  size_t done = 0;
+
+  if(offset < 0)
+    return NULL;
+
+  if(input->map)
   {
-    exc = rb_exc_new2(rb_eNotImpError, "Unknown blob format");
-    goto exit_nicely;
+    if((size_t)offset > input->map_size || length > input->map_size - (size_t)offset)
+      return NULL;
+
+    return input->map + offset;
   }
 
-  exit_nicely:
-    if(blob) osmpbf__blob__free_unpacked(blob, NULL);
-    if(!data) free(data);
-    if(exc != Qnil) rb_exc_raise(exc);
+  if(!buffer_reserve(buffer, length))
+    return NULL;
 
-  return data;
+  while(done < length)
+  {
+    ssize_t ret = pread(fileno(input->file), (char *)buffer->data + done, length - done, offset + done);
+
+    if(ret <= 0)
+      return NULL;
+
+    done += ret;
+  }
+
+  return buffer->data;
 }
+#endif
 
-static VALUE init_data_arr()
+// Hint the kernel that the next `length` bytes are about to be read
+static void input_willneed(pbf_input_t *input, size_t length)
 {
-  VALUE data = rb_hash_new();
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE)
+  if(input->map && input->map_pos < input->map_size)
+  {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t start = input->map_pos - (input->map_pos % page_size);
 
-  rb_hash_aset(data, STR2SYM("nodes"),      rb_ary_new());
-  rb_hash_aset(data, STR2SYM("ways"),       rb_ary_new());
-  rb_hash_aset(data, STR2SYM("relations"),  rb_ary_new());
+    if(length > input->map_size - input->map_pos)
+      length = input->map_size - input->map_pos;
 
-  return data;
+    madvise(input->map + start, length + (input->map_pos - start), MADV_WILLNEED);
+  }
+#endif
+}
+
+static int input_eof(pbf_input_t *input)
+{
+  if(input->map)
+    return input->map_pos >= input->map_size;
+
+  return feof(input->file);
 }
 
-static void add_info(VALUE hash, OSMPBF__Info *info, OSMPBF__StringTable *string_table, double ts_granularity)
+static long input_tell(pbf_input_t *input)
 {
-  VALUE version, timestamp, changeset, uid, user;
+  if(input->map)
+    return (long)input->map_pos;
 
-  version   = info->version   ? INT2NUM(info->version) : Qnil;
-  timestamp = info->timestamp ? LL2NUM(info->timestamp * ts_granularity) : Qnil;
-  changeset = info->changeset ? LL2NUM(info->changeset) : Qnil;
-  uid       = info->uid       ? INT2NUM(info->uid) : Qnil;
+  return ftell(input->file);
+}
 
-  if(info->user_sid)
+static int input_seek(pbf_input_t *input, long offset, int whence)
+{
+  if(input->map)
   {
-    char *user_sid = parse_binary_str(string_table->s[info->user_sid]);
-    user = str_new(user_sid);
-    free(user_sid);
+    long pos = whence == SEEK_CUR ? (long)input->map_pos + offset : offset;
+
+    if(pos < 0 || (size_t)pos > input->map_size)
+      return -1;
+
+    input->map_pos = (size_t)pos;
+
+    return 0;
   }
-  else
-    user = Qnil;
 
-  rb_hash_aset(hash, STR2SYM("version"), version);
-  rb_hash_aset(hash, STR2SYM("timestamp"), timestamp);
-  rb_hash_aset(hash, STR2SYM("changeset"), changeset);
-  rb_hash_aset(hash, STR2SYM("uid"), uid);
-  rb_hash_aset(hash, STR2SYM("user"), user);
+  return fseek(input->file, offset, whence);
 }
 
-static int parse_osm_header(VALUE obj, FILE *input)
+static size_t get_header_size(pbf_input_t *input, pbf_buffer_t *scratch)
 {
-  OSMPBF__BlobHeader *header = read_blob_header(input);
+  const unsigned char *buffer = input_read(input, scratch, 4);
+
+  if(buffer == NULL)
+    return 0;
+
+  // Network byte order
+  return ((size_t)buffer[0] << 24) | ((size_t)buffer[1] << 16) | ((size_t)buffer[2] << 8) | (size_t)buffer[3];
+}
+
+// Returns NULL without an error on the decoder when EOF is reached
+static OSMPBF__BlobHeader *decode_blob_header(pbf_input_t *input, pbf_decoder_t *decoder)
+{
+  const void *buffer;
+  size_t length = get_header_size(input, &decoder->compressed);
+  OSMPBF__BlobHeader *header = NULL;
+
+  if(length < 1 || length > MAX_BLOB_HEADER_SIZE)
+  {
+    if(input_eof(input))
+      return NULL;
+    else
+      return decoder_fail(decoder, &rb_eIOError, "Invalid blob header size");
+  }
+
+  if(!(buffer = input_read(input, &decoder->compressed, length)))
+    return decoder_fail(decoder, &rb_eIOError, "Unable to read the blob header");
+
+  // The previous blob is done with
+  arena_reset(&decoder->scratch);
+
+  header = osmpbf__blob_header__unpack(&decoder->scratch.allocator, length, buffer);
 
-  // EOF reached
   if(header == NULL)
-    rb_raise(rb_eEOFError, "EOF reached without finding data");
+    return decoder_fail(decoder, &rb_eIOError, "Unable to unpack the blob header");
 
-  if(strcmp("OSMHeader", header->type) != 0)
-    rb_raise(rb_eIOError, "OSMHeader not found, probably the file is corrupt or invalid");
+  input_willneed(input, header->datasize);
 
-  void *blob = NULL;
-  size_t blob_length = 0, datasize = header->datasize;
-  OSMPBF__HeaderBlock *header_block = NULL;
+  return header;
+}
 
-  osmpbf__blob_header__free_unpacked(header, NULL);
+static OSMPBF__BlobHeader *read_blob_header(pbf_input_t *input, pbf_decoder_t *decoder)
+{
+  OSMPBF__BlobHeader *header = decode_blob_header(input, decoder);
 
-  blob = read_blob(input, datasize, &blob_length);
-  header_block = osmpbf__header_block__unpack(NULL, blob_length, blob);
+  if(header == NULL)
+    decoder_raise(decoder);
 
-  free(blob);
+  return header;
+}
 
-  if(header_block == NULL)
-    rb_raise(rb_eIOError, "Unable to unpack the HeaderBlock");
+/*
+  Decompress a blob read into memory. The returned data lives in the decoder's
+  raw buffer and stays valid until the next blob is decoded. Like every decode_*
+  function this never raises, errors are left on the decoder instead. The blob
+  header must not be used past this point.
+*/
+static void *decode_blob(pbf_decoder_t *decoder, const void *buffer, size_t length, size_t *raw_length)
+{
+  OSMPBF__Blob *blob;
+  void *data = NULL;
 
-  VALUE header_hash = rb_hash_new();
-  VALUE bbox_hash   = rb_hash_new();
+  arena_reset(&decoder->scratch);
+  blob = osmpbf__blob__unpack(&decoder->scratch.allocator, length, buffer);
 
-  VALUE required_features = Qnil;
-  VALUE optional_features = Qnil;
-  VALUE writingprogram    = Qnil;
-  VALUE source            = Qnil;
+  if(blob == NULL)
+    return decoder_fail(decoder, &rb_eIOError, "Unable to read the blob");
 
-  VALUE osmosis_replication_timestamp       = Qnil;
-  VALUE osmosis_replication_sequence_number = Qnil;
-  VALUE osmosis_replication_base_url        = Qnil;
+  // raw_size is optional, assume the worst when it is missing
+  size_t raw_size = blob->has_raw_size ? (size_t)blob->raw_size : MAX_BLOB_SIZE;
 
-  int i = 0;
+  if(!blob->has_raw && (raw_size < 1 || raw_size > MAX_BLOB_SIZE))
+  {
+    return decoder_fail(decoder, &rb_eIOError, "Invalid raw blob size");
+  }
 
-  if(header_block->n_required_features > 0)
+  if(blob->has_raw)
   {
-    required_features = rb_ary_new();
+    if(blob->raw.len > MAX_BLOB_SIZE)
+    {
+      return decoder_fail(decoder, &rb_eIOError, "Invalid raw blob size");
+    }
 
-    for(i = 0; i < (int)header_block->n_required_features; i++)
-      rb_ary_push(required_features, str_new(header_block->required_features[i]));
-  }
+    if(!(data = buffer_reserve(&decoder->raw, blob->raw.len)))
+      return decoder_fail(decoder, &rb_eNoMemError, "Unable to allocate memory for the data");
 
-  if(header_block->n_optional_features > 0)
+    memcpy(data, blob->raw.data, blob->raw.len);
+    *raw_length = blob->raw.len;
+  }
+  else if(blob->has_zlib_data)
   {
-    optional_features = rb_ary_new();
+    if(!(data = buffer_reserve(&decoder->raw, raw_size)))
+      return decoder_fail(decoder, &rb_eNoMemError, "Unable to allocate memory for the data");
 
-    for(i = 0; i < (int)header_block->n_optional_features; i++)
-      rb_ary_push(optional_features, str_new(header_block->optional_features[i]));
+#ifdef HAVE_LIBDEFLATE
+    enum libdeflate_result ret;
+
+    if (!decoder->deflate && !(decoder->deflate = libdeflate_alloc_decompressor()))
+    {
+      return decoder_fail(decoder, &rb_eNoMemError, "Unable to allocate the libdeflate decompressor");
+    }
+
+    ret = libdeflate_zlib_decompress(decoder->deflate, blob->zlib_data.data, blob->zlib_data.len,
+                                     data, raw_size, raw_length);
+
+    if (ret == LIBDEFLATE_INSUFFICIENT_SPACE)
+    {
+      return decoder_fail(decoder, &rb_eIOError, "Zlib data is larger than the blob raw size");
+    }
+
+    if (ret != LIBDEFLATE_SUCCESS)
+    {
+      return decoder_fail(decoder, &rb_eRuntimeError, "Zlib compression failed");
+    }
+#else
+    int ret;
+    z_stream *strm = &decoder->strm;
+
+    if (decoder_inflate_reset(decoder) != Z_OK)
+    {
+      return decoder_fail(decoder, &rb_eRuntimeError, "Zlib init failed");
+    }
+
+    strm->avail_in = (unsigned int)blob->zlib_data.len;
+    strm->next_in = blob->zlib_data.data;
+    strm->avail_out = raw_size;
+    strm->next_out = data;
+
+    // Keep going while zlib makes progress instead of expecting one call to finish
+    do
+      ret = inflate(strm, Z_NO_FLUSH);
+    while (ret == Z_OK);
+
+    if (ret == Z_BUF_ERROR)
+    {
+      if (strm->avail_in == 0)
+        return decoder_fail(decoder, &rb_eIOError, "Zlib data is truncated");
+      else
+        return decoder_fail(decoder, &rb_eIOError, "Zlib data is larger than the blob raw size");
+    }
+
+    if (ret != Z_STREAM_END)
+    {
+      return decoder_fail(decoder, &rb_eRuntimeError, "Zlib compression failed");
+    }
+
+    *raw_length = strm->total_out;
+#endif
   }
+  else if(blob->has_lzma_data)
+  {
+#ifdef HAVE_LZMA
+    lzma_stream *strm = &decoder->lzma;
+    lzma_ret ret;
+
+    if(!(data = buffer_reserve(&decoder->raw, raw_size)))
+      return decoder_fail(decoder, &rb_eNoMemError, "Unable to allocate memory for the data");
+
+    // Reinitialising an existing stream reuses the decoder's memory
+    if(!decoder->lzma_ready)
+    {
+      lzma_stream init = LZMA_STREAM_INIT;
+      *strm = init;
+    }
+
+    if((ret = lzma_auto_decoder(strm, UINT64_MAX, 0)) != LZMA_OK)
+    {
+      return decoder_fail(decoder, &rb_eRuntimeError, "LZMA init failed");
+    }
+
+    decoder->lzma_ready = 1;
+
+    strm->next_in = blob->lzma_data.data;
+    strm->avail_in = blob->lzma_data.len;
+    strm->next_out = data;
+    strm->avail_out = raw_size;
+
+    ret = lzma_code(strm, LZMA_FINISH);
+
+    // A full buffer is reported as LZMA_OK, LZMA_BUF_ERROR only comes on a later call
+    if(ret != LZMA_STREAM_END && strm->avail_out == 0)
+    {
+      return decoder_fail(decoder, &rb_eIOError, "LZMA data is larger than the blob raw size");
+    }
+
+    if(ret != LZMA_STREAM_END)
+    {
+      return decoder_fail(decoder, &rb_eRuntimeError, "LZMA decompression failed");
+    }
+
+    *raw_length = raw_size - strm->avail_out;
+#else
+    return decoder_fail(decoder, &rb_eNotImpError, "LZMA compression is not supported");
+#endif
+  }
+  else if(blob->has_zstd_data)
+  {
+#ifdef HAVE_ZSTD
+    size_t ret;
+
+    if(!(data = buffer_reserve(&decoder->raw, raw_size)))
+      return decoder_fail(decoder, &rb_eNoMemError, "Unable to allocate memory for the data");
+
+    if(!decoder->zstd && !(decoder->zstd = ZSTD_createDCtx()))
+    {
+      return decoder_fail(decoder, &rb_eNoMemError, "Unable to allocate the zstd context");
+    }
+
+    ret = ZSTD_decompressDCtx(decoder->zstd, data, raw_size, blob->zstd_data.data, blob->zstd_data.len);
+
+    if(ZSTD_isError(ret) && ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall)
+    {
+      return decoder_fail(decoder, &rb_eIOError, "Zstandard data is larger than the blob raw size");
+    }
+
+    if(ZSTD_isError(ret))
+    {
+      return decoder_fail(decoder, &rb_eRuntimeError, "Zstandard decompression failed");
+    }
+
+    *raw_length = ret;
+#else
+    return decoder_fail(decoder, &rb_eNotImpError, "Zstandard compression is not supported");
+#endif
+  }
+  else if(blob->has_lz4_data)
+  {
+    return decoder_fail(decoder, &rb_eNotImpError, "LZ4 compression is not supported");
+  }
+  else
+  {
+    return decoder_fail(decoder, &rb_eNotImpError, "Unknown blob format");
+  }
+
+  return data;
+}
+
+/*
+  Decode a whole OSMData blob into a PrimitiveBlock allocated on the decoder's
+  arena. Safe to call without the GVL.
+*/
+static OSMPBF__PrimitiveBlock *decode_primitive_block(pbf_decoder_t *decoder, const void *buffer, size_t length)
+{
+  OSMPBF__PrimitiveBlock *primitive_block;
+  size_t raw_length = 0;
+  void *data;
+
+  if(!(data = decode_blob(decoder, buffer, length, &raw_length)))
+    return NULL;
+
+  if(!(primitive_block = osmpbf__primitive_block__unpack(&decoder->arena.allocator, raw_length, data)))
+    return decoder_fail(decoder, &rb_eIOError, "Unable to unpack the PrimitiveBlock");
+
+  return primitive_block;
+}
+
+static void range_add(pbf_range_t *range, int64_t value)
+{
+  if(value < range->min)
+    range->min = value;
+
+  if(value > range->max)
+    range->max = value;
+}
+
+/*
+  Record in `info` which entities the block holds, their ID ranges, the
+  bounding box of its nodes and its range of timestamps. Plain C, so it can
+  run on the worker threads.
+*/
+static void block_summarize(OSMPBF__PrimitiveBlock *block, pbf_blob_info_t *info)
+{
+  pbf_range_t *ranges[] = { &info->node_ids, &info->way_ids, &info->relation_ids, &info->lat, &info->lon, &info->timestamp };
+  int64_t granularity = block->granularity, ts_granularity = block->date_granularity;
+  size_t i, j;
+
+  for(i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+  {
+    ranges[i]->min = INT64_MAX;
+    ranges[i]->max = INT64_MIN;
+  }
+
+  info->flags = BLOB_INDEXED;
+
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = block->primitivegroup[i];
+    OSMPBF__DenseNodes *dense = group->dense;
+
+    for(j = 0; j < group->n_nodes; j++)
+    {
+      OSMPBF__Node *node = group->nodes[j];
+
+      range_add(&info->node_ids, node->id);
+      range_add(&info->lat, block->lat_offset + node->lat * granularity);
+      range_add(&info->lon, block->lon_offset + node->lon * granularity);
+
+      if(node->info && node->info->timestamp)
+        range_add(&info->timestamp, node->info->timestamp * ts_granularity);
+    }
+
+    if(dense)
+    {
+      int64_t id = 0, lat = 0, lon = 0, timestamp = 0;
+
+      for(j = 0; j < dense->n_id; j++)
+      {
+        id  += dense->id[j];
+        lat += dense->lat[j];
+        lon += dense->lon[j];
+
+        range_add(&info->node_ids, id);
+        range_add(&info->lat, block->lat_offset + lat * granularity);
+        range_add(&info->lon, block->lon_offset + lon * granularity);
+
+        if(dense->denseinfo && j < dense->denseinfo->n_timestamp)
+        {
+          timestamp += dense->denseinfo->timestamp[j];
+
+          if(timestamp)
+            range_add(&info->timestamp, timestamp * ts_granularity);
+        }
+      }
+    }
+
+    for(j = 0; j < group->n_ways; j++)
+    {
+      range_add(&info->way_ids, group->ways[j]->id);
+
+      if(group->ways[j]->info && group->ways[j]->info->timestamp)
+        range_add(&info->timestamp, group->ways[j]->info->timestamp * ts_granularity);
+    }
+
+    for(j = 0; j < group->n_relations; j++)
+    {
+      range_add(&info->relation_ids, group->relations[j]->id);
+
+      if(group->relations[j]->info && group->relations[j]->info->timestamp)
+        range_add(&info->timestamp, group->relations[j]->info->timestamp * ts_granularity);
+    }
+  }
+
+  if(info->node_ids.min <= info->node_ids.max)
+    info->flags |= BLOB_HAS_NODES;
+
+  if(info->way_ids.min <= info->way_ids.max)
+    info->flags |= BLOB_HAS_WAYS;
+
+  if(info->relation_ids.min <= info->relation_ids.max)
+    info->flags |= BLOB_HAS_RELATIONS;
+}
+
+#ifdef PBF_USE_THREADS
+static void pipeline_decode(pbf_input_t *input, pbf_slot_t *slot, pbf_job_t *job)
+{
+  pbf_decoder_t *decoder = &slot->decoder;
+  const void *buffer;
+
+  slot->block = NULL;
+
+  if(job->data_size < 1 || job->data_size > MAX_BLOB_SIZE)
+  {
+    decoder_fail(decoder, &rb_eIOError, "Invalid blob size");
+    return;
+  }
+
+  if(!(buffer = input_read_at(input, &decoder->compressed, job->data_pos, job->data_size)))
+  {
+    decoder_fail(decoder, &rb_eIOError, "Unable to read the blob");
+    return;
+  }
+
+  slot->block = decode_primitive_block(decoder, buffer, job->data_size);
+
+  if(slot->block && job->info)
+    block_summarize(slot->block, job->info);
+}
+
+static void *pipeline_worker(void *arg)
+{
+  pbf_pipeline_t *pipeline = arg;
+
+  pthread_mutex_lock(&pipeline->lock);
+
+  for(;;)
+  {
+    while(!pipeline->stop && pipeline->next_job < pipeline->n_jobs &&
+          pipeline->next_job >= pipeline->next_result + pipeline->n_slots)
+      pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+    if(pipeline->stop || pipeline->next_job >= pipeline->n_jobs)
+      break;
+
+    size_t job = pipeline->next_job++;
+    pbf_slot_t *slot = &pipeline->slots[job % pipeline->n_slots];
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pipeline_decode(pipeline->input, slot, &pipeline->jobs[job]);
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    slot->done = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return NULL;
+}
+
+static void *pipeline_join(void *arg)
+{
+  pbf_pipeline_t *pipeline = arg;
+  int i;
+
+  for(i = 0; i < pipeline->n_threads; i++)
+    pthread_join(pipeline->threads[i], NULL);
+
+  return NULL;
+}
+
+/*
+  Stop the workers and free everything. Takes ownership of the jobs. The GVL
+  is released while waiting for the workers unless called from GC.
+*/
+static void pipeline_stop(pbf_pipeline_t *pipeline, int release_gvl)
+{
+  size_t i;
+
+  if(pipeline->threads)
+  {
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    // Workers finish the blob they are on, don't hold up other Ruby threads meanwhile
+    if(release_gvl)
+      rb_thread_call_without_gvl(pipeline_join, pipeline, NULL, NULL);
+    else
+      pipeline_join(pipeline);
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->cond);
+  }
+
+  for(i = 0; pipeline->slots && i < pipeline->n_slots; i++)
+    decoder_free(&pipeline->slots[i].decoder);
+
+  free(pipeline->slots);
+  free(pipeline->threads);
+  free(pipeline->jobs);
+
+  memset(pipeline, 0, sizeof(pbf_pipeline_t));
+}
+
+static void pipeline_start(pbf_pipeline_t *pipeline, pbf_input_t *input, pbf_job_t *jobs, size_t n_jobs, int n_threads, size_t n_slots)
+{
+  size_t i;
+
+  memset(pipeline, 0, sizeof(pbf_pipeline_t));
+
+  pipeline->input   = input;
+  pipeline->jobs    = jobs;
+  pipeline->n_jobs  = n_jobs;
+  pipeline->n_slots = n_slots;
+
+  pipeline->slots   = calloc(n_slots, sizeof(pbf_slot_t));
+  pipeline->threads = calloc(n_threads, sizeof(pthread_t));
+
+  if(!pipeline->slots || !pipeline->threads)
+  {
+    free(pipeline->threads);
+    pipeline->threads = NULL;
+    pipeline_stop(pipeline, 1);
+    rb_raise(rb_eNoMemError, "Unable to allocate memory for the decoding threads");
+  }
+
+  for(i = 0; i < n_slots; i++)
+    decoder_init(&pipeline->slots[i].decoder);
+
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+
+  for(pipeline->n_threads = 0; pipeline->n_threads < n_threads; pipeline->n_threads++)
+  {
+    if(pthread_create(&pipeline->threads[pipeline->n_threads], NULL, pipeline_worker, pipeline) != 0)
+      break;
+  }
+
+  if(pipeline->n_threads == 0)
+  {
+    pipeline_stop(pipeline, 1);
+    rb_raise(rb_eRuntimeError, "Unable to start the decoding threads");
+  }
+}
+
+static void *pipeline_wait(void *arg)
+{
+  pbf_pipeline_t *pipeline = arg;
+  pbf_slot_t *slot = &pipeline->slots[pipeline->next_result % pipeline->n_slots];
+
+  pthread_mutex_lock(&pipeline->lock);
+
+  while(!slot->done && !pipeline->interrupted)
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+  pipeline->interrupted = 0;
+
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return NULL;
+}
+
+static void pipeline_unblock(void *arg)
+{
+  pbf_pipeline_t *pipeline = arg;
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->interrupted = 1;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Wait for the next job in order, NULL once all of them have been delivered
+static pbf_slot_t *pipeline_next(pbf_pipeline_t *pipeline)
+{
+  pbf_slot_t *slot;
+
+  if(pipeline->next_result >= pipeline->n_jobs)
+    return NULL;
+
+  slot = &pipeline->slots[pipeline->next_result % pipeline->n_slots];
+
+  for(;;)
+  {
+    pthread_mutex_lock(&pipeline->lock);
+    int done = slot->done;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if(done)
+      return slot;
+
+    rb_thread_call_without_gvl(pipeline_wait, pipeline, pipeline_unblock, pipeline);
+    rb_thread_check_ints();
+  }
+}
+
+// Hand a delivered slot back to the workers
+static void pipeline_release(pbf_pipeline_t *pipeline, pbf_slot_t *slot)
+{
+  arena_reset(&slot->decoder.arena);
+
+  pthread_mutex_lock(&pipeline->lock);
+
+  slot->done  = 0;
+  slot->block = NULL;
+  pipeline->next_result++;
+
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+#endif
+
+// Read the still compressed blob that follows a blob header
+static const void *decode_blob_data(pbf_input_t *input, pbf_decoder_t *decoder, size_t length)
+{
+  const void *buffer;
+
+  if(length < 1 || length > MAX_BLOB_SIZE)
+    return decoder_fail(decoder, &rb_eIOError, "Invalid blob size");
+
+  if(!(buffer = input_read(input, &decoder->compressed, length)))
+    return decoder_fail(decoder, &rb_eIOError, "Unable to read the blob");
+
+  return buffer;
+}
+
+static void *read_blob(pbf_input_t *input, pbf_decoder_t *decoder, size_t length, size_t *raw_length)
+{
+  const void *buffer;
+  void *data = NULL;
+
+  if(!(buffer = decode_blob_data(input, decoder, length)) ||
+     !(data = decode_blob(decoder, buffer, length, raw_length)))
+    decoder_raise(decoder);
+
+  return data;
+}
+
+/*
+  Read the next OSMData blob and unpack it. Runs without the GVL and checks
+  for interruptions between stages, in which case it gives up quietly and the
+  caller rewinds the input.
+*/
+static void *read_primitive_block_step(void *arg)
+{
+  pbf_step_t *step = arg;
+  pbf_decoder_t *decoder = step->decoder;
+  OSMPBF__BlobHeader *header;
+  const void *buffer;
+  size_t datasize;
+
+  if(!(header = decode_blob_header(step->input, decoder)))
+    return NULL;
+
+  if(strcmp("OSMData", header->type) != 0)
+    return decoder_fail(decoder, &rb_eIOError, "OSMData not found");
+
+  datasize = header->datasize;
+
+  if(step->interrupted || !(buffer = decode_blob_data(step->input, decoder, datasize)))
+    return NULL;
+
+  if(step->interrupted)
+    return NULL;
+
+  step->block = decode_primitive_block(decoder, buffer, datasize);
+
+  return NULL;
+}
+
+// Collect the position of every OSMData blob from the current position onwards
+static void *scan_blobs_step(void *arg)
+{
+  pbf_step_t *step = arg;
+  pbf_input_t *input = step->input;
+  OSMPBF__BlobHeader *header;
+  size_t capacity = 0;
+  long pos = input_tell(input);
+
+  while(!step->interrupted && (header = decode_blob_header(input, step->decoder)) != NULL)
+  {
+    size_t datasize = header->datasize;
+
+    if(strcmp(header->type, "OSMData") == 0)
+    {
+      if(step->n_blobs == capacity)
+      {
+        pbf_blob_info_t *blobs = realloc(step->blobs, (capacity = capacity ? capacity * 2 : 1024) * sizeof(pbf_blob_info_t));
+
+        if(!blobs)
+          return decoder_fail(step->decoder, &rb_eNoMemError, "Unable to allocate memory for the blob list");
+
+        step->blobs = blobs;
+      }
+
+      pbf_blob_info_t *info = &step->blobs[step->n_blobs++];
+
+      info->header_pos  = pos + 4;
+      info->data_pos    = input_tell(input);
+      info->header_size = info->data_pos - pos - 4;
+      info->data_size   = datasize;
+      info->flags       = 0;
+    }
+
+    arena_reset(&step->decoder->arena);
+
+    if(0 != input_seek(input, datasize, SEEK_CUR))
+      break; // cut losses
+
+    pos = input_tell(input);
+  }
+
+  return NULL;
+}
+
+// Decoding steps let other threads run, which must not touch the same parser
+static void check_idle(pbf_parser_t *parser)
+{
+  if(parser->busy)
+    rb_raise(rb_eRuntimeError, "PbfParser is being used by another thread");
+}
+
+static void step_unblock(void *arg)
+{
+  pbf_step_t *step = arg;
+
+  step->interrupted = 1;
+}
+
+static void *step_run(void *arg)
+{
+  pbf_step_t *step = arg;
+
+  step->func(step);
+  step->finished = 1;
+
+  return NULL;
+}
+
+/*
+  Run a step without the GVL so other Ruby threads keep going meanwhile. If an
+  interrupt comes in the step stops early (or doesn't start), the parser is
+  left idle and rewound, and only then are pending interrupts handled, which
+  may raise. The step is run again if they don't.
+*/
+static void run_step(pbf_parser_t *parser, void *(*func)(void *), pbf_step_t *step)
+{
+  long start = input_tell(&parser->input);
+
+  check_idle(parser);
+
+  for(;;)
+  {
+    step->func        = func;
+    step->input       = &parser->input;
+    step->decoder     = &parser->decoder;
+    step->block       = NULL;
+    step->n_blobs     = 0;
+    step->interrupted = 0;
+    step->finished    = 0;
+
+    parser->busy = 1;
+
+#if defined(HAVE_RB_NOGVL)
+    // Interrupts are left pending, so nothing raises before busy is cleared
+    rb_nogvl(step_run, step, step_unblock, step, RB_NOGVL_INTR_FAIL);
+#elif defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+    rb_thread_call_without_gvl(step_run, step, step_unblock, step);
+#else
+    step_run(step);
+#endif
+
+    parser->busy = 0;
+
+    if(step->finished && (!step->interrupted || step->block))
+      return;
+
+    parser->decoder.error = NULL;
+    arena_reset(&parser->decoder.arena);
+
+    // A blob list cut short is scanned again from the start
+    free(step->blobs);
+    step->blobs = NULL;
+
+    if(0 != input_seek(&parser->input, start, SEEK_SET))
+      rb_raise(rb_eIOError, "Unable to seek to file position");
+
+    rb_thread_check_ints();
+  }
+}
+
+// FNV-1a, enough to tell apart two files with the same size and mtime
+static uint64_t checksum(const void *data, size_t length)
+{
+  const unsigned char *bytes = data;
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  for(i = 0; i < length; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/*
+  Fill in what identifies the file in its index: size, mtime and a checksum of
+  the OSMHeader fileblock, which ends at `header_end`. The input is left at
+  `header_end`.
+*/
+static void index_init(pbf_index_t *index, const char *path, const char *filename, pbf_input_t *input, pbf_buffer_t *scratch, long header_end)
+{
+  struct stat st;
+  const void *header;
+
+  if(stat(filename, &st) != 0 || 0 != input_seek(input, 0, SEEK_SET))
+    rb_raise(rb_eIOError, "Unable to read the file");
+
+  header = input_read(input, scratch, (size_t)header_end);
+
+  if(!header || 0 != input_seek(input, header_end, SEEK_SET))
+    rb_raise(rb_eIOError, "Unable to read the file");
+
+  memcpy(index->key.magic, INDEX_MAGIC, sizeof(index->key.magic));
+  index->key.version         = INDEX_VERSION;
+  index->key.entry_size      = sizeof(pbf_blob_info_t);
+  index->key.file_size       = (uint64_t)st.st_size;
+  index->key.file_mtime      = (int64_t)st.st_mtime;
+  index->key.header_checksum = checksum(header, (size_t)header_end);
+
+  index->path = strdup(path);
+}
+
+static void index_free(pbf_index_t *index)
+{
+#ifdef HAVE_SYS_MMAN_H
+  if(index->map)
+    munmap(index->map, index->map_size);
+  else
+#endif
+    free(index->blobs);
+
+  free(index->path);
+  memset(index, 0, sizeof(pbf_index_t));
+}
+
+// Map the sidecar index if there is one matching the file
+static int index_load(pbf_index_t *index)
+{
+#ifdef HAVE_SYS_MMAN_H
+  const pbf_index_header_t *header;
+  struct stat st;
+  void *map;
+  int fd = open(index->path, O_RDONLY);
+
+  if(fd < 0)
+    return 0;
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(pbf_index_header_t))
+  {
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(map == MAP_FAILED)
+    return 0;
+
+  header = map;
+
+  // The key stored on disk must match the one computed for the file
+  if(memcmp(header, &index->key, offsetof(pbf_index_header_t, n_blobs)) != 0 ||
+     header->n_blobs > ((size_t)st.st_size - sizeof(pbf_index_header_t)) / sizeof(pbf_blob_info_t))
+  {
+    munmap(map, (size_t)st.st_size);
+    return 0;
+  }
+
+  index->map      = map;
+  index->map_size = (size_t)st.st_size;
+  index->blobs    = (pbf_blob_info_t *)(header + 1);
+  index->n_blobs  = header->n_blobs;
+
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/*
+  Write the index next to the file. It goes to a temporary file first so that
+  concurrent readers never see a partial index. Failing to write it only
+  means the next parser scans the file again.
+*/
+static void index_save(pbf_index_t *index)
+{
+  pbf_index_header_t header = index->key;
+  size_t length = strlen(index->path);
+  char *tmp = malloc(length + 5);
+  FILE *file;
+  int ok;
+
+  if(!tmp)
+    return;
+
+  snprintf(tmp, length + 5, "%s.tmp", index->path);
+
+  if(!(file = fopen(tmp, "wb")))
+  {
+    rb_warning("Unable to write the blob index %s", index->path);
+    free(tmp);
+    return;
+  }
+
+  header.n_blobs = index->n_blobs;
+
+  ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(index->blobs, sizeof(pbf_blob_info_t), index->n_blobs, file) == index->n_blobs;
+  ok = fclose(file) == 0 && ok;
+
+  if(!ok || rename(tmp, index->path) != 0)
+  {
+    rb_warning("Unable to write the blob index %s", index->path);
+    remove(tmp);
+  }
+
+  free(tmp);
+}
+
+// Copy a mapped index to memory so that it can be updated
+static void index_own(pbf_index_t *index)
+{
+#ifdef HAVE_SYS_MMAN_H
+  pbf_blob_info_t *blobs;
+
+  if(!index->map)
+    return;
+
+  if(!(blobs = malloc(index->n_blobs * sizeof(pbf_blob_info_t) + 1)))
+    rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob list");
+
+  memcpy(blobs, index->blobs, index->n_blobs * sizeof(pbf_blob_info_t));
+  munmap(index->map, index->map_size);
+
+  index->map   = NULL;
+  index->blobs = blobs;
+#endif
+}
+
+// Blob list of the parser, read from the sidecar index or found by scanning the file
+static pbf_index_t *index_get(pbf_parser_t *parser)
+{
+  pbf_index_t *index = &parser->index;
+  pbf_input_t *input = &parser->input;
+  pbf_step_t step = { 0 };
+  long old_pos;
+
+  if(index->loaded)
+    return index;
+
+  if(index->path && index_load(index))
+  {
+    index->loaded = 1;
+    return index;
+  }
+
+  check_idle(parser);
+
+  old_pos = input_tell(input);
+
+  if (0 != input_seek(input, 0, SEEK_SET)) {
+    rb_raise(rb_eIOError, "Unable to seek to beginning of file");
+  }
+
+  arena_reset(&parser->decoder.arena);
+
+  // Walking the headers of a big file takes a while, do it without the GVL
+  run_step(parser, scan_blobs_step, &step);
+
+  // restore old position
+  if (0 != input_seek(input, old_pos, SEEK_SET)) {
+    free(step.blobs);
+    rb_raise(rb_eIOError, "Unable to restore old file position");
+  }
+
+  if (parser->decoder.error) {
+    free(step.blobs);
+    decoder_raise(&parser->decoder);
+  }
+
+  index->blobs   = step.blobs;
+  index->n_blobs = step.n_blobs;
+  index->loaded  = 1;
+
+  if(index->path)
+    index_save(index);
+
+  return index;
+}
+
+/*
+  Decode the given blob into the parser's arena, leaving the input and the
+  current block alone. The result is valid until the arena is reset.
+*/
+static OSMPBF__PrimitiveBlock *read_block_at(pbf_parser_t *parser, size_t blob)
+{
+  pbf_input_t *input = &parser->input;
+  long old_pos;
+  pbf_step_t step = { 0 };
+
+  // Before touching the arena or the input another thread may be decoding with
+  check_idle(parser);
+
+  old_pos = input_tell(input);
+  arena_reset(&parser->decoder.arena);
+
+  if(0 != input_seek(input, parser->index.blobs[blob].header_pos - 4, SEEK_SET))
+    rb_raise(rb_eIOError, "Unable to seek to file position");
+
+  run_step(parser, read_primitive_block_step, &step);
+
+  if(0 != input_seek(input, old_pos, SEEK_SET))
+    rb_raise(rb_eIOError, "Unable to restore old file position");
+
+  if(!step.block)
+    decoder_raise(&parser->decoder);
+
+  return step.block;
+}
+
+/*
+  What a blob contains, from the index if #build_index has seen it or by
+  decoding it. A decoded block is also handed to `probe`, if given.
+*/
+static pbf_blob_info_t *blob_summary(pbf_parser_t *parser, size_t blob, pbf_blob_info_t *scratch, const pbf_probe_t *probe)
+{
+  OSMPBF__PrimitiveBlock *block;
+
+  if(parser->index.blobs[blob].flags & BLOB_INDEXED)
+    return &parser->index.blobs[blob];
+
+  *scratch = parser->index.blobs[blob];
+  block = read_block_at(parser, blob);
+  block_summarize(block, scratch);
+
+  if(probe)
+    probe->func(probe->arg, blob, block);
+
+  arena_reset(&parser->decoder.arena);
+
+  return scratch;
+}
+
+static pbf_range_t *blob_ids(pbf_blob_info_t *info, int type)
+{
+  switch(type)
+  {
+    case BLOB_HAS_NODES: return &info->node_ids;
+    case BLOB_HAS_WAYS:  return &info->way_ids;
+    default:             return &info->relation_ids;
+  }
+}
+
+static int header_has_feature(VALUE obj, const char *feature)
+{
+  VALUE header = rb_iv_get(obj, "@header");
+  VALUE name = str_new(feature);
+  const char *keys[] = { "required_features", "optional_features" };
+  int i;
+
+  for(i = 0; i < 2; i++)
+  {
+    VALUE features = rb_hash_aref(header, str_new(keys[i]));
+
+    if(RB_TYPE_P(features, T_ARRAY) && RTEST(rb_ary_includes(features, name)))
+      return 1;
+  }
+
+  return 0;
+}
+
+// A blob without entities has no place in the sort order
+static int blob_is_empty(pbf_blob_info_t *info)
+{
+  return !(info->flags & (BLOB_HAS_NODES | BLOB_HAS_WAYS | BLOB_HAS_RELATIONS));
+}
+
+/*
+  Whether the first entity of a non-empty blob sorts before or at the given
+  one. With Sort.Type_then_ID nodes come first, then ways, then relations,
+  each by ID, and BLOB_HAS_* flags are in that order too.
+*/
+static int blob_starts_before(pbf_blob_info_t *info, int type, int64_t id)
+{
+  int types = info->flags & (BLOB_HAS_NODES | BLOB_HAS_WAYS | BLOB_HAS_RELATIONS);
+  int first = types & -types;
+
+  return first < type || (first == type && blob_ids(info, type)->min <= id);
+}
+
+static pbf_blob_info_t *search_summary(pbf_parser_t *parser, long blob, pbf_blob_info_t *cache, pbf_blob_info_t *scratch, const pbf_probe_t *probe)
+{
+  pbf_blob_info_t *info = cache ? &cache[blob] : scratch;
+
+  if(!cache)
+    scratch->flags = 0;
+
+  if(!(info->flags & BLOB_INDEXED))
+    info = blob_summary(parser, blob, info, probe);
+
+  return info;
+}
+
+/*
+  Binary search a sorted file for the last blob, from `lo` on, starting at or
+  before the given entity. Summaries of decoded blobs are kept in `cache`, if
+  given, for the next search, and the blocks are handed to `probe`, if given.
+  Empty blobs are never returned. Returns lo - 1 if there is none.
+*/
+static long search_sorted(pbf_parser_t *parser, int type, int64_t id, long lo, pbf_blob_info_t *cache, const pbf_probe_t *probe)
+{
+  pbf_blob_info_t scratch, *info;
+  long hi = (long)parser->index.n_blobs - 1, blob = lo - 1;
+
+  while(lo <= hi)
+  {
+    long mid = lo + (hi - lo) / 2, next = mid;
+
+    // Empty blobs would break the ordering, compare with the next one holding entities
+    info = search_summary(parser, next, cache, &scratch, probe);
+
+    while(blob_is_empty(info) && next < hi)
+      info = search_summary(parser, ++next, cache, &scratch, probe);
+
+    if(!blob_is_empty(info) && blob_starts_before(info, type, id))
+    {
+      blob = next;
+      lo   = next + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+
+  return blob;
+}
+
+// Whether the indexed ID range of a blob rules out an entity
+static int blob_excludes(pbf_blob_info_t *info, int type, int64_t id)
+{
+  if(!(info->flags & BLOB_INDEXED))
+    return 0;
+
+  return !(info->flags & type) || id < blob_ids(info, type)->min || id > blob_ids(info, type)->max;
+}
+
+/*
+  Which entity types each blob may hold, so that blobs without any wanted
+  type can be skipped without inflating them. Blobs #build_index has seen are
+  known exactly. In sorted files every type lies in a range of blobs, found by
+  binary search. NULL if neither applies, as finding out would take decoding
+  everything.
+*/
+static const unsigned char *get_blob_types(VALUE obj)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  int sorted = header_has_feature(obj, "Sort.Type_then_ID");
+  long first[3], last[3], blob;
+  pbf_index_t *index;
+  int type;
+
+  if(parser->blob_types_ready)
+    return parser->blob_types;
+
+  parser->blob_types_ready = 1;
+
+  // Only worth scanning the blob headers if something can come out of it
+  if(!sorted && !parser->index.path)
+    return NULL;
+
+  index = index_get(parser);
+
+  if(sorted)
+  {
+    VALUE cache_buf;
+    pbf_blob_info_t *cache = ALLOCV_N(pbf_blob_info_t, cache_buf, index->n_blobs + 1);
+
+    memset(cache, 0, (index->n_blobs + 1) * sizeof(pbf_blob_info_t));
+
+    // Type t starts in the last blob starting with an earlier type and ends in
+    // the last blob starting before the next type
+    for(type = 0; type < 3; type++)
+    {
+      long start = search_sorted(parser, BLOB_HAS_NODES << type, INT64_MIN, 0, cache, NULL);
+
+      first[type] = start < 0 ? 0 : start;
+      last[type]  = type < 2 ? search_sorted(parser, BLOB_HAS_NODES << (type + 1), INT64_MIN, 0, cache, NULL) : (long)index->n_blobs - 1;
+    }
+
+    ALLOCV_END(cache_buf);
+  }
+
+  if(!(parser->blob_types = malloc(index->n_blobs + 1)))
+    rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob list");
+
+  for(blob = 0; blob < (long)index->n_blobs; blob++)
+  {
+    pbf_blob_info_t *info = &index->blobs[blob];
+
+    parser->blob_types[blob] = BLOB_ALL_TYPES;
+
+    if(info->flags & BLOB_INDEXED)
+      parser->blob_types[blob] = info->flags & BLOB_ALL_TYPES;
+    else if(sorted)
+      for(type = 0; type < 3; type++)
+        if(blob < first[type] || blob > last[type])
+          parser->blob_types[blob] &= ~(BLOB_HAS_NODES << type);
+  }
+
+  return parser->blob_types;
+}
+
+static VALUE init_data_arr()
+{
+  VALUE data = rb_hash_new();
+
+  rb_hash_aset(data, sym_nodes,      rb_ary_new());
+  rb_hash_aset(data, sym_ways,       rb_ary_new());
+  rb_hash_aset(data, sym_relations,  rb_ary_new());
+
+  return data;
+}
+
+static int parse_osm_header(VALUE obj, pbf_input_t *input, pbf_decoder_t *decoder)
+{
+  arena_reset(&decoder->arena);
+
+  OSMPBF__BlobHeader *header = read_blob_header(input, decoder);
+
+  // EOF reached
+  if(header == NULL)
+    rb_raise(rb_eEOFError, "EOF reached without finding data");
+
+  if(strcmp("OSMHeader", header->type) != 0)
+    rb_raise(rb_eIOError, "OSMHeader not found, probably the file is corrupt or invalid");
+
+  void *blob = NULL;
+  size_t blob_length = 0, datasize = header->datasize;
+  OSMPBF__HeaderBlock *header_block = NULL;
+
+  blob = read_blob(input, decoder, datasize, &blob_length);
+  header_block = osmpbf__header_block__unpack(&decoder->arena.allocator, blob_length, blob);
+
+  if(header_block == NULL)
+    rb_raise(rb_eIOError, "Unable to unpack the HeaderBlock");
+
+  VALUE header_hash = rb_hash_new();
+  VALUE bbox_hash   = rb_hash_new();
+
+  VALUE required_features = Qnil;
+  VALUE optional_features = Qnil;
+  VALUE writingprogram    = Qnil;
+  VALUE source            = Qnil;
+
+  VALUE osmosis_replication_timestamp       = Qnil;
+  VALUE osmosis_replication_sequence_number = Qnil;
+  VALUE osmosis_replication_base_url        = Qnil;
+
+  int i = 0;
+
+  if(header_block->n_required_features > 0)
+  {
+    required_features = rb_ary_new();
+
+    for(i = 0; i < (int)header_block->n_required_features; i++)
+      rb_ary_push(required_features, str_new(header_block->required_features[i]));
+  }
+
+  if(header_block->n_optional_features > 0)
+  {
+    optional_features = rb_ary_new();
+
+    for(i = 0; i < (int)header_block->n_optional_features; i++)
+      rb_ary_push(optional_features, str_new(header_block->optional_features[i]));
+  }
+
+  if(header_block->writingprogram)
+    writingprogram = str_new(header_block->writingprogram);
+
+  if(header_block->source)
+    source = str_new(header_block->source);
+
+  if(header_block->bbox)
+  {
+    rb_hash_aset(bbox_hash, sym_top,    rb_float_new(header_block->bbox->top * NANO_DEGREE));
+    rb_hash_aset(bbox_hash, sym_right,  rb_float_new(header_block->bbox->right * NANO_DEGREE));
+    rb_hash_aset(bbox_hash, sym_bottom, rb_float_new(header_block->bbox->bottom * NANO_DEGREE));
+    rb_hash_aset(bbox_hash, sym_left,   rb_float_new(header_block->bbox->left * NANO_DEGREE));
+  }
+
+  if(header_block->has_osmosis_replication_timestamp)
+    osmosis_replication_timestamp = ULL2NUM(header_block->osmosis_replication_timestamp);
+
+  if(header_block->has_osmosis_replication_sequence_number)
+    osmosis_replication_sequence_number = ULL2NUM(header_block->osmosis_replication_sequence_number);
+
+  if(header_block->osmosis_replication_base_url)
+    osmosis_replication_base_url = str_new(header_block->osmosis_replication_base_url);
+
+  rb_hash_aset(header_hash, str_new("bbox"), bbox_hash);
+  rb_hash_aset(header_hash, str_new("required_features"), required_features);
+  rb_hash_aset(header_hash, str_new("optional_features"), optional_features);
+  rb_hash_aset(header_hash, str_new("writing_program"), writingprogram);
+  rb_hash_aset(header_hash, str_new("source"), source);
+  rb_hash_aset(header_hash, str_new("osmosis_replication_timestamp"), osmosis_replication_timestamp);
+  rb_hash_aset(header_hash, str_new("osmosis_replication_sequence_number"), osmosis_replication_sequence_number);
+  rb_hash_aset(header_hash, str_new("osmosis_replication_base_url"), osmosis_replication_base_url);
+
+  rb_iv_set(obj, "@header", header_hash);
+
+  arena_reset(&decoder->arena);
+
+  return 1;
+}
+
+static void string_cache_init(pbf_string_cache_t *cache, size_t capacity)
+{
+  memset(cache, 0, sizeof(*cache));
+
+  cache->capacity = capacity;
+  cache->newest   = STRING_CACHE_NONE;
+  cache->oldest   = STRING_CACHE_NONE;
+}
+
+static void string_cache_free(pbf_string_cache_t *cache)
+{
+  free(cache->entries);
+  free(cache->buckets);
+
+  string_cache_init(cache, cache->capacity);
+}
+
+static void string_cache_mark(pbf_string_cache_t *cache)
+{
+  size_t i;
+
+  for(i = 0; i < cache->size; i++)
+    rb_gc_mark(cache->entries[i].string);
+}
+
+// Take entry `e` out of the LRU list
+static void string_cache_unlink(pbf_string_cache_t *cache, uint32_t e)
+{
+  pbf_string_entry_t *entry = &cache->entries[e];
+
+  if(entry->newer != STRING_CACHE_NONE)
+    cache->entries[entry->newer].older = entry->older;
+  else
+    cache->newest = entry->older;
+
+  if(entry->older != STRING_CACHE_NONE)
+    cache->entries[entry->older].newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+}
+
+// Make entry `e` the most recently used
+static void string_cache_push(pbf_string_cache_t *cache, uint32_t e)
+{
+  pbf_string_entry_t *entry = &cache->entries[e];
+
+  entry->newer = STRING_CACHE_NONE;
+  entry->older = cache->newest;
+
+  if(cache->newest != STRING_CACHE_NONE)
+    cache->entries[cache->newest].newer = e;
+  else
+    cache->oldest = e;
+
+  cache->newest = e;
+}
+
+// Frozen string with the given bytes, from the cache if it holds one
+static VALUE string_cache_get(pbf_string_cache_t *cache, ProtobufCBinaryData bstr)
+{
+  pbf_string_entry_t *entry;
+  uint64_t hash;
+  uint32_t e, *link;
+  VALUE string;
+
+  if(!cache->capacity)
+    return str_intern(bstr);
+
+  if(!cache->entries)
+  {
+    for(cache->n_buckets = 1; cache->n_buckets < cache->capacity; cache->n_buckets <<= 1);
+
+    cache->entries = malloc(cache->capacity * sizeof(pbf_string_entry_t));
+    cache->buckets = malloc(cache->n_buckets * sizeof(uint32_t));
+
+    if(!cache->entries || !cache->buckets)
+    {
+      string_cache_free(cache);
+      rb_raise(rb_eNoMemError, "Unable to allocate the string cache");
+    }
+
+    memset(cache->buckets, 0xff, cache->n_buckets * sizeof(uint32_t));
+  }
+
+  hash = checksum(bstr.data, bstr.len);
+
+  for(e = cache->buckets[hash & (cache->n_buckets - 1)]; e != STRING_CACHE_NONE; e = entry->next)
+  {
+    entry = &cache->entries[e];
+
+    if(entry->hash == hash && RSTRING_LEN(entry->string) == (long)bstr.len && !memcmp(RSTRING_PTR(entry->string), bstr.data, bstr.len))
+    {
+      cache->hits++;
+
+      if(e != cache->newest)
+      {
+        string_cache_unlink(cache, e);
+        string_cache_push(cache, e);
+      }
+
+      return entry->string;
+    }
+  }
+
+  cache->misses++;
+
+  // Create the string before touching the entries, it may run the GC
+  string = str_intern(bstr);
+
+  if(cache->size < cache->capacity)
+    e = cache->size++;
+  else
+  {
+    // Evict the least recently used string
+    e = cache->oldest;
+    entry = &cache->entries[e];
+
+    for(link = &cache->buckets[entry->hash & (cache->n_buckets - 1)]; *link != e; link = &cache->entries[*link].next);
+    *link = entry->next;
+
+    string_cache_unlink(cache, e);
+  }
+
+  entry = &cache->entries[e];
+  link  = &cache->buckets[hash & (cache->n_buckets - 1)];
+
+  entry->hash   = hash;
+  entry->string = string;
+  entry->next   = *link;
+  *link         = e;
+
+  string_cache_push(cache, e);
+
+  return string;
+}
+
+/*
+  Same result as Float#round(7), which coordinates always went through, without
+  calling into Ruby. Rounds half away from zero, then corrects for the error in
+  x * 1e7 like Ruby's round_half_up does.
+*/
+static double round7(double x)
+{
+  const double s = 1e7;
+  double f = round(x * s);
+
+  if(x > 0 && (double)((f + 0.5) / s) <= x)
+    f += 1;
+  else if(x < 0 && (double)((f - 0.5) / s) >= x)
+    f -= 1;
+
+  return f / s;
+}
+
+// Coordinate as an integer, in e7 units if asked for and nanodegrees otherwise
+static int64_t coordinate_fixed(const pbf_convert_t *convert, int64_t offset, int64_t value)
+{
+  int64_t nanodegrees = offset + value * convert->granularity;
+
+  if(convert->coordinates == COORDINATES_E7)
+    return (nanodegrees + (nanodegrees < 0 ? -50 : 50)) / 100;
+
+  return nanodegrees;
+}
+
+// Coordinate in the unit asked for with coordinates:, from its value in the block
+static VALUE coordinate_new(const pbf_convert_t *convert, int64_t offset, int64_t value)
+{
+  if(convert->coordinates == COORDINATES_DEGREES)
+    return rb_float_new(round7(NANO_DEGREE * (offset + value * convert->granularity)));
+
+  return LL2NUM(coordinate_fixed(convert, offset, value));
+}
+
+// Set up the conversion of the entities of a block with the parser's options
+static void convert_init(pbf_convert_t *convert, pbf_parser_t *parser, OSMPBF__PrimitiveBlock *block)
+{
+  convert->string_table    = block->stringtable;
+  convert->lat_offset      = block->lat_offset;
+  convert->lon_offset      = block->lon_offset;
+  convert->granularity     = block->granularity;
+  convert->ts_granularity  = block->date_granularity;
+  convert->node_fields     = parser->node_fields;
+  convert->way_fields      = parser->way_fields;
+  convert->relation_fields = parser->relation_fields;
+  convert->coordinates     = parser->coordinates;
+  convert->packed          = parser->packed;
+  convert->structs         = parser->structs;
+  convert->strings         = rb_ary_new_capa(block->stringtable->n_s);
+  convert->cache           = &parser->strings;
+}
+
+/*
+  String `sid` of the block's string table. Each one is only looked up in the
+  parser's string cache the first time it is used in the block, and is then
+  shared by every entity referring to it.
+*/
+static VALUE string_table_get(const pbf_convert_t *convert, uint32_t sid)
+{
+  VALUE string = rb_ary_entry(convert->strings, sid);
+
+  if(NIL_P(string))
+  {
+    string = string_cache_get(convert->cache, convert->string_table->s[sid]);
+    rb_ary_store(convert->strings, sid, string);
+  }
+
+  return string;
+}
+
+// One of the FIELD_INFO fields of `info`
+static VALUE info_field(OSMPBF__Info *info, const pbf_convert_t *convert, int field)
+{
+  switch(field)
+  {
+    case FIELD_VERSION:
+      return info->version ? INT2NUM(info->version) : Qnil;
+    case FIELD_TIMESTAMP:
+      return info->timestamp ? LL2NUM(info->timestamp * (int64_t)convert->ts_granularity) : Qnil;
+    case FIELD_CHANGESET:
+      return info->changeset ? LL2NUM(info->changeset) : Qnil;
+    case FIELD_UID:
+      return info->uid ? INT2NUM(info->uid) : Qnil;
+    case FIELD_USER:
+      return info->user_sid ? string_table_get(convert, info->user_sid) : Qnil;
+  }
+
+  return Qnil;
+}
+
+// New entity of `klass` with structs:, a hash otherwise
+static VALUE entity_alloc(const pbf_convert_t *convert, VALUE klass)
+{
+  return convert->structs ? rb_struct_alloc_noinit(klass) : rb_hash_new();
+}
+
+// Set a field of an entity, by `key` in a hash and by member `slot` in a struct
+static void entity_set(VALUE entity, VALUE key, long slot, VALUE value)
+{
+  if(RB_TYPE_P(entity, T_HASH))
+    rb_hash_aset(entity, key, value);
+  else
+    RSTRUCT_SET(entity, slot, value);
+}
+
+// Set the info fields of an entity, `slot` being where they start in a struct
+static void add_info(VALUE entity, OSMPBF__Info *info, const pbf_convert_t *convert, int fields, long slot)
+{
+  if(fields & FIELD_VERSION)
+    entity_set(entity, sym_version, slot, info_field(info, convert, FIELD_VERSION));
+
+  if(fields & FIELD_TIMESTAMP)
+    entity_set(entity, sym_timestamp, slot + 1, info_field(info, convert, FIELD_TIMESTAMP));
+
+  if(fields & FIELD_CHANGESET)
+    entity_set(entity, sym_changeset, slot + 2, info_field(info, convert, FIELD_CHANGESET));
+
+  if(fields & FIELD_UID)
+    entity_set(entity, sym_uid, slot + 3, info_field(info, convert, FIELD_UID));
+
+  if(fields & FIELD_USER)
+    entity_set(entity, sym_user, slot + 4, info_field(info, convert, FIELD_USER));
+}
+
+static VALUE tags_new(const pbf_convert_t *convert, size_t n_keys, const uint32_t *keys, const uint32_t *vals)
+{
+  VALUE tags = rb_hash_new();
+  size_t j;
+
+  for(j = 0; j < n_keys; j++)
+    rb_hash_aset(tags, string_table_get(convert, keys[j]), string_table_get(convert, vals[j]));
+
+  return tags;
+}
+
+static VALUE node_new(OSMPBF__Node *node, const pbf_convert_t *convert)
+{
+  int fields = convert->node_fields;
+
+  VALUE node_out = entity_alloc(convert, node_class);
+
+  if(fields & FIELD_ID)
+    entity_set(node_out, sym_id, NODE_ID, LL2NUM(node->id));
+
+  if(fields & FIELD_LAT)
+    entity_set(node_out, sym_lat, NODE_LAT, coordinate_new(convert, convert->lat_offset, node->lat));
+
+  if(fields & FIELD_LON)
+    entity_set(node_out, sym_lon, NODE_LON, coordinate_new(convert, convert->lon_offset, node->lon));
+
+  if(node->info && (fields & FIELD_INFO))
+    add_info(node_out, node->info, convert, fields, NODE_INFO);
+
+  if(fields & FIELD_TAGS)
+    entity_set(node_out, sym_tags, NODE_TAGS, tags_new(convert, node->n_keys, node->keys, node->vals));
+
+  return node_out;
+}
+
+static void process_nodes(VALUE out, OSMPBF__PrimitiveGroup *group, const pbf_convert_t *convert)
+{
+  size_t i = 0;
+
+  for(i = 0; i < group->n_nodes; i++)
+    rb_ary_push(out, node_new(group->nodes[i], convert));
+}
+
+// Move the cursor to the next node, undoing the delta coding
+static void dense_next(OSMPBF__DenseNodes *dense_nodes, pbf_dense_cursor_t *cursor)
+{
+  size_t i = cursor->i++;
+
+  cursor->id  += dense_nodes->id[i];
+  cursor->lat += dense_nodes->lat[i];
+  cursor->lon += dense_nodes->lon[i];
+
+  if(dense_nodes->denseinfo)
+  {
+    cursor->version    = dense_nodes->denseinfo->version[i];
+    cursor->timestamp += dense_nodes->denseinfo->timestamp[i];
+    cursor->changeset += dense_nodes->denseinfo->changeset[i];
+    cursor->user_sid  += dense_nodes->denseinfo->user_sid[i];
+    cursor->uid       += dense_nodes->denseinfo->uid[i];
+  }
+
+  // Tags of all the nodes follow each other in keys_vals, each list ending with a 0
+  cursor->tags = cursor->next_tags;
+
+  if(cursor->next_tags < dense_nodes->n_keys_vals)
+  {
+    while(cursor->next_tags < dense_nodes->n_keys_vals && dense_nodes->keys_vals[cursor->next_tags] != 0)
+      cursor->next_tags += 2;
+
+    cursor->next_tags += 1;
+  }
+}
+
+// Info of the node the cursor is on
+static void dense_info(pbf_dense_cursor_t *cursor, OSMPBF__Info *info)
+{
+  memset(info, 0, sizeof(*info));
+
+  info->version   = cursor->version;
+  info->timestamp = cursor->timestamp;
+  info->changeset = cursor->changeset;
+  info->user_sid  = cursor->user_sid;
+  info->uid       = cursor->uid;
+}
+
+// Tags of the node the cursor is on
+static VALUE dense_tags_new(OSMPBF__DenseNodes *dense_nodes, pbf_dense_cursor_t *cursor, const pbf_convert_t *convert)
+{
+  VALUE tags = rb_hash_new();
+  size_t j;
+
+  for(j = cursor->tags; j + 1 < dense_nodes->n_keys_vals && dense_nodes->keys_vals[j] != 0; j += 2)
+    rb_hash_aset(tags, string_table_get(convert, dense_nodes->keys_vals[j]), string_table_get(convert, dense_nodes->keys_vals[j+1]));
+
+  return tags;
+}
+
+// Convert the node the cursor is on
+static VALUE dense_node_new(OSMPBF__DenseNodes *dense_nodes, pbf_dense_cursor_t *cursor, const pbf_convert_t *convert)
+{
+  int fields = convert->node_fields;
+  VALUE node = entity_alloc(convert, node_class);
+
+  if(fields & FIELD_ID)
+    entity_set(node, sym_id, NODE_ID, LL2NUM(cursor->id));
+
+  if(fields & FIELD_LAT)
+    entity_set(node, sym_lat, NODE_LAT, coordinate_new(convert, convert->lat_offset, cursor->lat));
+
+  if(fields & FIELD_LON)
+    entity_set(node, sym_lon, NODE_LON, coordinate_new(convert, convert->lon_offset, cursor->lon));
+
+  // Extract info
+  if(dense_nodes->denseinfo && (fields & FIELD_INFO))
+  {
+    OSMPBF__Info info;
+
+    dense_info(cursor, &info);
+    add_info(node, &info, convert, fields, NODE_INFO);
+  }
+
+  // Extract tags
+  if(fields & FIELD_TAGS)
+    entity_set(node, sym_tags, NODE_TAGS, dense_tags_new(dense_nodes, cursor, convert));
+
+  return node;
+}
+
+static void process_dense_nodes(VALUE out, OSMPBF__DenseNodes *dense_nodes, const pbf_convert_t *convert)
+{
+  pbf_dense_cursor_t cursor = { 0 };
+
+  while(cursor.i < dense_nodes->n_id)
+  {
+    dense_next(dense_nodes, &cursor);
+    rb_ary_push(out, dense_node_new(dense_nodes, &cursor, convert));
+  }
+}
+
+// Store `value` as a little-endian int64, returning where the next one goes
+static char *pack_int64(char *out, int64_t value)
+{
+  uint64_t bits = (uint64_t)value;
+  int i;
+
+  for(i = 0; i < 8; i++, bits >>= 8)
+    *out++ = (char)(bits & 0xff);
+
+  return out;
+}
+
+// Store `value` as a little-endian uint32, returning where the next one goes
+static char *pack_uint32(char *out, uint32_t value)
+{
+  int i;
+
+  for(i = 0; i < 4; i++, value >>= 8)
+    *out++ = (char)(value & 0xff);
+
+  return out;
+}
+
+static size_t packed_ids_memsize(const void *ptr)
+{
+  const pbf_packed_ids_t *ids = ptr;
+
+  return ids ? sizeof(pbf_packed_ids_t) + ids->size * sizeof(int64_t) : 0;
+}
+
+static const rb_data_type_t packed_ids_type = {
+  "PbfParser::PackedIds",
+  { NULL, RUBY_TYPED_DEFAULT_FREE, packed_ids_memsize },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// PbfParser::PackedIds with room for `size` IDs, for the caller to fill in
+static VALUE packed_ids_new(size_t size, int64_t **out)
+{
+  VALUE obj = TypedData_Wrap_Struct(packed_ids_class, &packed_ids_type, NULL);
+  pbf_packed_ids_t *ids = xmalloc(sizeof(pbf_packed_ids_t) + size * sizeof(int64_t));
+
+  ids->size = (long)size;
+  *out = ids->ids;
+
+  DATA_PTR(obj) = ids;
+
+  return obj;
+}
+
+static VALUE packed_ids_size(VALUE self)
+{
+  pbf_packed_ids_t *ids = rb_check_typeddata(self, &packed_ids_type);
+
+  return LONG2NUM(ids->size);
+}
+
+static VALUE packed_ids_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return packed_ids_size(self);
+}
+
+static VALUE packed_ids_aref(VALUE self, VALUE index)
+{
+  pbf_packed_ids_t *ids = rb_check_typeddata(self, &packed_ids_type);
+  long i = NUM2LONG(index);
+
+  if(i < 0)
+    i += ids->size;
+
+  if(i < 0 || i >= ids->size)
+    return Qnil;
+
+  return LL2NUM(ids->ids[i]);
+}
+
+static VALUE packed_ids_each(VALUE self)
+{
+  pbf_packed_ids_t *ids = rb_check_typeddata(self, &packed_ids_type);
+  long i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, packed_ids_enum_size);
+
+  for(i = 0; i < ids->size; i++)
+    rb_yield(LL2NUM(ids->ids[i]));
+
+  return self;
+}
+
+// The IDs as a String of little-endian int64, ready for String#unpack("q<*")
+static VALUE packed_ids_packed(VALUE self)
+{
+  pbf_packed_ids_t *ids = rb_check_typeddata(self, &packed_ids_type);
+  VALUE packed = rb_str_new(NULL, 8 * ids->size);
+  char *out = RSTRING_PTR(packed);
+  long i;
+
+  for(i = 0; i < ids->size; i++)
+    out = pack_int64(out, ids->ids[i]);
+
+  return packed;
+}
+
+static VALUE packed_ids_equal(VALUE self, VALUE other)
+{
+  pbf_packed_ids_t *ids = rb_check_typeddata(self, &packed_ids_type);
+  pbf_packed_ids_t *other_ids;
+
+  if(!rb_typeddata_is_kind_of(other, &packed_ids_type))
+    return Qfalse;
+
+  other_ids = DATA_PTR(other);
+
+  return ids->size == other_ids->size && !memcmp(ids->ids, other_ids->ids, ids->size * sizeof(int64_t)) ? Qtrue : Qfalse;
+}
+
+static VALUE packed_ids_inspect(VALUE self)
+{
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE">", rb_class_name(CLASS_OF(self)), rb_inspect(rb_funcall(self, rb_intern("to_a"), 0)));
+}
+
+// Packed column of `n` int64, or nil if the field isn't wanted
+static VALUE column_new(int fields, int field, size_t n, char **out)
+{
+  VALUE column;
+
+  if(!(fields & field))
+  {
+    *out = NULL;
+    return Qnil;
+  }
+
+  column = rb_str_new(NULL, 8 * n);
+  *out = RSTRING_PTR(column);
+
+  return column;
+}
+
+/*
+  All the nodes of a block as columns, for the node_columns: option. IDs and
+  coordinates are packed little-endian int64, the coordinates in e7 units if
+  coordinates: asks for them and nanodegrees otherwise. The tags of node i are
+  the entries tag_offsets[i] to tag_offsets[i + 1] of tag_keys and tag_values.
+*/
+static VALUE nodes_columns_new(OSMPBF__PrimitiveBlock *block, const pbf_convert_t *convert)
+{
+  int fields = convert->node_fields;
+  VALUE columns = rb_hash_new();
+  VALUE ids, lats, lons, offsets, keys = Qnil, values = Qnil;
+  char *id_out, *lat_out, *lon_out, *offset_out;
+  int64_t n_tags = 0;
+  size_t n = 0, i, j;
+
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    n += block->primitivegroup[i]->n_nodes;
+
+    if(block->primitivegroup[i]->dense)
+      n += block->primitivegroup[i]->dense->n_id;
+  }
+
+  ids     = column_new(fields, FIELD_ID, n, &id_out);
+  lats    = column_new(fields, FIELD_LAT, n, &lat_out);
+  lons    = column_new(fields, FIELD_LON, n, &lon_out);
+  offsets = column_new(fields, FIELD_TAGS, n + 1, &offset_out);
+
+  if(fields & FIELD_TAGS)
+  {
+    keys   = rb_ary_new();
+    values = rb_ary_new();
+  }
+
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = block->primitivegroup[i];
+
+    for(j = 0; j < group->n_nodes; j++)
+    {
+      OSMPBF__Node *node = group->nodes[j];
+      size_t k;
+
+      if(id_out)
+        id_out = pack_int64(id_out, node->id);
+
+      if(lat_out)
+        lat_out = pack_int64(lat_out, coordinate_fixed(convert, convert->lat_offset, node->lat));
+
+      if(lon_out)
+        lon_out = pack_int64(lon_out, coordinate_fixed(convert, convert->lon_offset, node->lon));
+
+      if(offset_out)
+      {
+        offset_out = pack_int64(offset_out, n_tags);
+
+        for(k = 0; k < node->n_keys; k++, n_tags++)
+        {
+          rb_ary_push(keys, string_table_get(convert, node->keys[k]));
+          rb_ary_push(values, string_table_get(convert, node->vals[k]));
+        }
+      }
+    }
+
+    if(group->dense)
+    {
+      OSMPBF__DenseNodes *dense_nodes = group->dense;
+      pbf_dense_cursor_t cursor = { 0 };
+
+      while(cursor.i < dense_nodes->n_id)
+      {
+        dense_next(dense_nodes, &cursor);
+
+        if(id_out)
+          id_out = pack_int64(id_out, cursor.id);
+
+        if(lat_out)
+          lat_out = pack_int64(lat_out, coordinate_fixed(convert, convert->lat_offset, cursor.lat));
+
+        if(lon_out)
+          lon_out = pack_int64(lon_out, coordinate_fixed(convert, convert->lon_offset, cursor.lon));
+
+        if(offset_out)
+        {
+          offset_out = pack_int64(offset_out, n_tags);
+
+          for(j = cursor.tags; j + 1 < dense_nodes->n_keys_vals && dense_nodes->keys_vals[j] != 0; j += 2, n_tags++)
+          {
+            rb_ary_push(keys, string_table_get(convert, dense_nodes->keys_vals[j]));
+            rb_ary_push(values, string_table_get(convert, dense_nodes->keys_vals[j+1]));
+          }
+        }
+      }
+    }
+  }
+
+  if(offset_out)
+    pack_int64(offset_out, n_tags);
+
+  rb_hash_aset(columns, sym_size, SIZET2NUM(n));
+
+  if(fields & FIELD_ID)
+    rb_hash_aset(columns, sym_ids, ids);
+
+  if(fields & FIELD_LAT)
+    rb_hash_aset(columns, sym_lat, lats);
+
+  if(fields & FIELD_LON)
+    rb_hash_aset(columns, sym_lon, lons);
+
+  if(fields & FIELD_TAGS)
+  {
+    rb_hash_aset(columns, sym_tag_offsets, offsets);
+    rb_hash_aset(columns, sym_tag_keys, keys);
+    rb_hash_aset(columns, sym_tag_values, values);
+  }
+
+  return columns;
+}
+
+// Node IDs of a way, delta decoded, as PackedIds with packed: or an Array
+static VALUE refs_new(OSMPBF__Way *way, const pbf_convert_t *convert)
+{
+  int64_t delta_refs = 0;
+  unsigned k;
+
+  if(convert->packed)
+  {
+    int64_t *out;
+    VALUE refs = packed_ids_new(way->n_refs, &out);
+
+    for(k = 0; k < way->n_refs; k++)
+    {
+      delta_refs += way->refs[k];
+      out[k] = delta_refs;
+    }
+
+    return refs;
+  }
+
+  VALUE refs = rb_ary_new2(way->n_refs);
+
+  for(k = 0; k < way->n_refs; k++)
+  {
+    delta_refs += way->refs[k];
+    rb_ary_push(refs, LL2NUM(delta_refs));
+  }
+
+  return refs;
+}
+
+static VALUE way_new(OSMPBF__Way *way, const pbf_convert_t *convert)
+{
+  int fields = convert->way_fields;
+
+  VALUE way_out = entity_alloc(convert, way_class);
+
+  if(fields & FIELD_ID)
+    entity_set(way_out, sym_id, ENTITY_ID, LL2NUM(way->id));
+
+  // Extract info
+  if(way->info && (fields & FIELD_INFO))
+    add_info(way_out, way->info, convert, fields, ENTITY_INFO);
+
+  // Extract tags
+  if(fields & FIELD_TAGS)
+    entity_set(way_out, sym_tags, ENTITY_TAGS, tags_new(convert, way->n_keys, way->keys, way->vals));
+
+  // Extract refs
+  if(fields & FIELD_REFS)
+    entity_set(way_out, sym_refs, ENTITY_REFS, refs_new(way, convert));
+
+  return way_out;
+}
+
+static void process_ways(VALUE out, OSMPBF__PrimitiveGroup *group, const pbf_convert_t *convert)
+{
+  size_t i = 0;
+
+  for(i = 0; i < group->n_ways; i++)
+    rb_ary_push(out, way_new(group->ways[i], convert));
+}
+
+/*
+  Members of a relation for the packed: option, in their original order. `ids`
+  are PackedIds, `types` one byte per member (0 node, 1 way, 2 relation) and
+  `roles` a little-endian uint32 per member indexing `role_names`.
+*/
+static VALUE packed_members_new(OSMPBF__Relation *relation, const pbf_convert_t *convert)
+{
+  int64_t *id_out;
+  VALUE members    = rb_hash_new();
+  VALUE ids        = packed_ids_new(relation->n_memids, &id_out);
+  VALUE types      = rb_str_new(NULL, relation->n_memids);
+  VALUE roles      = rb_str_new(NULL, 4 * relation->n_memids);
+  VALUE role_names = rb_ary_new();
+  char *type_out = RSTRING_PTR(types), *role_out = RSTRING_PTR(roles);
+  VALUE role_sids_buf;
+  // At most one role per member, on the stack or owned by Ruby in case anything below raises
+  int32_t *role_sids = ALLOCV_N(int32_t, role_sids_buf, relation->n_memids + 1);
+  int64_t delta_memids = 0;
+  size_t k, r;
+
+  for(k = 0; k < relation->n_memids; k++)
+  {
+    delta_memids += relation->memids[k];
+    id_out[k] = delta_memids;
+
+    *type_out++ = (char)(k < relation->n_types ? relation->types[k] : 0);
+
+    // A relation only uses a few roles, a linear search is enough
+    int32_t sid = k < relation->n_roles_sid ? relation->roles_sid[k] : 0;
+
+    for(r = 0; r < (size_t)RARRAY_LEN(role_names) && role_sids[r] != sid; r++);
+
+    if(r == (size_t)RARRAY_LEN(role_names))
+    {
+      role_sids[r] = sid;
+      rb_ary_push(role_names, string_table_get(convert, sid));
+    }
+
+    role_out = pack_uint32(role_out, (uint32_t)r);
+  }
+
+  ALLOCV_END(role_sids_buf);
+
+  rb_hash_aset(members, sym_ids, ids);
+  rb_hash_aset(members, sym_types, rb_obj_freeze(types));
+  rb_hash_aset(members, sym_roles, rb_obj_freeze(roles));
+  rb_hash_aset(members, sym_role_names, role_names);
+
+  return members;
+}
+
+// Members of a relation, split by type unless packed: is set
+static VALUE members_new(OSMPBF__Relation *relation, const pbf_convert_t *convert)
+{
+  if(convert->packed)
+    return packed_members_new(relation, convert);
+
+  VALUE members   = rb_hash_new();
+  VALUE nodes     = rb_ary_new();
+  VALUE ways      = rb_ary_new();
+  VALUE relations = rb_ary_new();
+
+  int64_t delta_memids = 0;
+  unsigned k;
+
+  for(k = 0; k < relation->n_memids; k++)
+  {
+    VALUE member = rb_hash_new();
+
+    delta_memids += relation->memids[k];
+
+    rb_hash_aset(member, sym_id, LL2NUM(delta_memids));
+
+    if(relation->roles_sid[k])
+      rb_hash_aset(member, sym_role, string_table_get(convert, relation->roles_sid[k]));
+
+    switch(relation->types[k])
+    {
+      case OSMPBF__RELATION__MEMBER_TYPE__NODE:
+        rb_ary_push(nodes, member);
+        break;
+      case OSMPBF__RELATION__MEMBER_TYPE__WAY:
+        rb_ary_push(ways, member);
+        break;
+      case OSMPBF__RELATION__MEMBER_TYPE__RELATION:
+        rb_ary_push(relations, member);
+        break;
+    }
+  }
+
+  rb_hash_aset(members, sym_nodes, nodes);
+  rb_hash_aset(members, sym_ways, ways);
+  rb_hash_aset(members, sym_relations, relations);
+
+  return members;
+}
+
+static VALUE relation_new(OSMPBF__Relation *relation, const pbf_convert_t *convert)
+{
+  int fields = convert->relation_fields;
+  VALUE relation_out = entity_alloc(convert, relation_class);
+
+  if(fields & FIELD_ID)
+    entity_set(relation_out, sym_id, ENTITY_ID, LL2NUM(relation->id));
+
+  // Extract info
+  if(relation->info && (fields & FIELD_INFO))
+    add_info(relation_out, relation->info, convert, fields, ENTITY_INFO);
+
+  // Extract tags
+  if(fields & FIELD_TAGS)
+    entity_set(relation_out, sym_tags, ENTITY_TAGS, tags_new(convert, relation->n_keys, relation->keys, relation->vals));
+
+  // Extract members
+  if(fields & FIELD_MEMBERS)
+    entity_set(relation_out, sym_members, ENTITY_MEMBERS, members_new(relation, convert));
+
+  return relation_out;
+}
+
+static void process_relations(VALUE out, OSMPBF__PrimitiveGroup *group, const pbf_convert_t *convert)
+{
+  size_t i = 0;
+
+  for(i = 0; i < group->n_relations; i++)
+    rb_ary_push(out, relation_new(group->relations[i], convert));
+}
+
+// Convert the entity of the given type (BLOB_HAS_*) and ID if the block has it
+static VALUE block_find(pbf_parser_t *parser, OSMPBF__PrimitiveBlock *block, int type, int64_t id)
+{
+  pbf_convert_t convert;
+  size_t i, j;
+
+  convert_init(&convert, parser, block);
+
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = block->primitivegroup[i];
+
+    if(type == BLOB_HAS_NODES)
+    {
+      for(j = 0; j < group->n_nodes; j++)
+        if(group->nodes[j]->id == id)
+          return node_new(group->nodes[j], &convert);
+
+      if(group->dense)
+      {
+        pbf_dense_cursor_t cursor = { 0 };
+
+        while(cursor.i < group->dense->n_id)
+        {
+          dense_next(group->dense, &cursor);
+
+          if(cursor.id == id)
+            return dense_node_new(group->dense, &cursor, &convert);
+        }
+      }
+    }
+
+    if(type == BLOB_HAS_WAYS)
+      for(j = 0; j < group->n_ways; j++)
+        if(group->ways[j]->id == id)
+          return way_new(group->ways[j], &convert);
+
+    if(type == BLOB_HAS_RELATIONS)
+      for(j = 0; j < group->n_relations; j++)
+        if(group->relations[j]->id == id)
+          return relation_new(group->relations[j], &convert);
+  }
+
+  return Qnil;
+}
+
+// Convert a types: option to BLOB_HAS_* flags, nil meaning all of them
+static int parse_types(VALUE list)
+{
+  int types = 0;
+  long i;
+
+  if(NIL_P(list))
+    return BLOB_ALL_TYPES;
+
+  list = rb_Array(list);
+
+  for(i = 0; i < RARRAY_LEN(list); i++)
+  {
+    VALUE type = rb_ary_entry(list, i);
+
+    if(type == sym_nodes)
+      types |= BLOB_HAS_NODES;
+    else if(type == sym_ways)
+      types |= BLOB_HAS_WAYS;
+    else if(type == sym_relations)
+      types |= BLOB_HAS_RELATIONS;
+    else
+      rb_raise(rb_eArgError, "Unknown entity type %+"PRIsVALUE, type);
+  }
+
+  return types;
+}
+
+// Entity types asked for in a call's options, the parser's default otherwise
+static int option_types(VALUE obj, VALUE options)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+
+  if(NIL_P(options) || !RTEST(rb_funcall(options, id_key_p, 1, sym_types)))
+    return parser->types;
+
+  return parse_types(rb_hash_aref(options, sym_types));
+}
+
+// FIELD_* flag of a field name, 0 if there is none
+static int field_from_name(VALUE name)
+{
+  if(name == sym_id)
+    return FIELD_ID;
+  else if(name == sym_lat)
+    return FIELD_LAT;
+  else if(name == sym_lon)
+    return FIELD_LON;
+  else if(name == sym_version)
+    return FIELD_VERSION;
+  else if(name == sym_timestamp)
+    return FIELD_TIMESTAMP;
+  else if(name == sym_changeset)
+    return FIELD_CHANGESET;
+  else if(name == sym_uid)
+    return FIELD_UID;
+  else if(name == sym_user)
+    return FIELD_USER;
+  else if(name == sym_tags)
+    return FIELD_TAGS;
+  else if(name == sym_refs)
+    return FIELD_REFS;
+  else if(name == sym_members)
+    return FIELD_MEMBERS;
+
+  return 0;
+}
+
+// Convert a list of field names to FIELD_* flags, nil meaning all of them
+static int parse_field_list(VALUE list)
+{
+  int fields = 0;
+  long i;
+
+  if(NIL_P(list))
+    return FIELD_ALL;
+
+  list = rb_Array(list);
+
+  for(i = 0; i < RARRAY_LEN(list); i++)
+  {
+    VALUE name = rb_ary_entry(list, i);
+    int field = field_from_name(name);
+
+    if(!field && name == STR2SYM("info"))
+      field = FIELD_INFO;
+
+    if(!field)
+      rb_raise(rb_eArgError, "Unknown field %+"PRIsVALUE, name);
+
+    fields |= field;
+  }
+
+  return fields;
+}
+
+// Apply a fields: option, entity types it leaves out keep all their fields
+static void parse_fields(pbf_parser_t *parser, VALUE fields)
+{
+  VALUE keys;
+  long i;
+
+  parser->node_fields     = FIELD_ALL;
+  parser->way_fields      = FIELD_ALL;
+  parser->relation_fields = FIELD_ALL;
+
+  if(NIL_P(fields))
+    return;
+
+  Check_Type(fields, T_HASH);
+
+  keys = rb_funcall(fields, rb_intern("keys"), 0);
+
+  for(i = 0; i < RARRAY_LEN(keys); i++)
+  {
+    VALUE type = rb_ary_entry(keys, i);
+    int mask = parse_field_list(rb_hash_aref(fields, type));
+
+    if(type == sym_nodes)
+      parser->node_fields = mask;
+    else if(type == sym_ways)
+      parser->way_fields = mask;
+    else if(type == sym_relations)
+      parser->relation_fields = mask;
+    else
+      rb_raise(rb_eArgError, "Unknown entity type %+"PRIsVALUE, type);
+  }
+}
+
+static void lazy_block_mark(void *ptr)
+{
+  pbf_lazy_block_t *lazy = ptr;
+
+  rb_gc_mark(lazy->convert.strings);
+  rb_gc_mark(lazy->parser);
+}
+
+static void lazy_block_free(void *ptr)
+{
+  pbf_lazy_block_t *lazy = ptr;
+
+  arena_release(&lazy->arena);
+  xfree(lazy->nodes);
+  xfree(lazy->ways);
+  xfree(lazy->relations);
+  xfree(lazy);
+}
+
+static size_t lazy_block_memsize(const void *ptr)
+{
+  const pbf_lazy_block_t *lazy = ptr;
+
+  return sizeof(pbf_lazy_block_t) + lazy->arena.capacity
+    + lazy->n_nodes * sizeof(pbf_lazy_node_t)
+    + (lazy->n_ways + lazy->n_relations) * sizeof(void *);
+}
+
+static const rb_data_type_t lazy_block_type = {
+  "PbfParser::LazyBlock",
+  { lazy_block_mark, lazy_block_free, lazy_block_memsize },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+  Keep an unpacked block for the lazy: option. The memory of `arena` goes to
+  the block, which is a hidden object freed with the last entity using it.
+*/
+static VALUE lazy_block_new(VALUE obj, OSMPBF__PrimitiveBlock *primitive_block, pbf_arena_t *arena, int types)
+{
+  pbf_lazy_block_t *lazy;
+  VALUE block = TypedData_Make_Struct(0, pbf_lazy_block_t, &lazy_block_type, lazy);
+
+  convert_init(&lazy->convert, DATA_PTR(obj), primitive_block);
+  lazy->convert.structs = 0; // LazyEntity#to_h
+
+  lazy->parser = obj;
+  lazy->block  = primitive_block;
+  lazy->types  = types;
+
+  arena_move(arena, &lazy->arena);
+
+  return block;
+}
+
+// List the entities of a lazy block, in the order the eager conversion gives them
+static void lazy_block_index(pbf_lazy_block_t *lazy)
+{
+  OSMPBF__PrimitiveBlock *block = lazy->block;
+  size_t n_nodes = 0, n_ways = 0, n_relations = 0, i, j;
+
+  if(lazy->indexed)
+    return;
+
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = block->primitivegroup[i];
+
+    if(lazy->types & BLOB_HAS_NODES)
+      n_nodes += group->n_nodes + (group->dense ? group->dense->n_id : 0);
+
+    if(lazy->types & BLOB_HAS_WAYS)
+      n_ways += group->n_ways;
+
+    if(lazy->types & BLOB_HAS_RELATIONS)
+      n_relations += group->n_relations;
+  }
+
+  lazy->nodes     = ALLOC_N(pbf_lazy_node_t, n_nodes);
+  lazy->ways      = ALLOC_N(OSMPBF__Way *, n_ways);
+  lazy->relations = ALLOC_N(OSMPBF__Relation *, n_relations);
+
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = block->primitivegroup[i];
+
+    if(lazy->types & BLOB_HAS_NODES)
+    {
+      for(j = 0; j < group->n_nodes; j++)
+      {
+        pbf_lazy_node_t *node = &lazy->nodes[lazy->n_nodes++];
+
+        memset(node, 0, sizeof(*node));
+        node->node = group->nodes[j];
+      }
+
+      if(group->dense)
+      {
+        pbf_dense_cursor_t cursor = { 0 };
+
+        while(cursor.i < group->dense->n_id)
+        {
+          pbf_lazy_node_t *node = &lazy->nodes[lazy->n_nodes++];
+
+          dense_next(group->dense, &cursor);
+
+          node->node   = NULL;
+          node->dense  = group->dense;
+          node->cursor = cursor;
+        }
+      }
+    }
+
+    if(lazy->types & BLOB_HAS_WAYS)
+      for(j = 0; j < group->n_ways; j++)
+        lazy->ways[lazy->n_ways++] = group->ways[j];
+
+    if(lazy->types & BLOB_HAS_RELATIONS)
+      for(j = 0; j < group->n_relations; j++)
+        lazy->relations[lazy->n_relations++] = group->relations[j];
+  }
+
+  lazy->indexed = 1;
+}
+
+static void lazy_ref_mark(void *ptr)
+{
+  rb_gc_mark(((pbf_lazy_ref_t *)ptr)->block);
+}
+
+static const rb_data_type_t lazy_ref_type = {
+  "PbfParser::LazyEntity",
+  { lazy_ref_mark, RUBY_TYPED_DEFAULT_FREE, NULL },
+  NULL, NULL, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE lazy_ref_new(VALUE klass, VALUE block, int type, size_t index)
+{
+  pbf_lazy_ref_t *ref;
+  VALUE obj = TypedData_Make_Struct(klass, pbf_lazy_ref_t, &lazy_ref_type, ref);
+
+  ref->block = block;
+  ref->type  = type;
+  ref->index = index;
+
+  return obj;
+}
+
+// The reference behind a LazyEntities or LazyEntity, with its block indexed
+static pbf_lazy_ref_t *lazy_ref_get(VALUE self, pbf_lazy_block_t **lazy)
+{
+  pbf_lazy_ref_t *ref = rb_check_typeddata(self, &lazy_ref_type);
+
+  *lazy = RTYPEDDATA_DATA(ref->block);
+  lazy_block_index(*lazy);
+
+  return ref;
+}
+
+static size_t lazy_block_count(pbf_lazy_block_t *lazy, int type)
+{
+  switch(type)
+  {
+    case BLOB_HAS_NODES:
+      return lazy->n_nodes;
+    case BLOB_HAS_WAYS:
+      return lazy->n_ways;
+    default:
+      return lazy->n_relations;
+  }
+}
+
+/*
+  PbfParser::LazyEntities, the nodes, ways or relations of a block as
+  LazyEntity objects created when they are asked for.
+*/
+static VALUE lazy_entities_size(VALUE self)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+
+  return SIZET2NUM(lazy_block_count(lazy, ref->type));
+}
+
+static VALUE lazy_entities_enum_size(VALUE self, VALUE args, VALUE eobj)
+{
+  return lazy_entities_size(self);
+}
+
+static VALUE lazy_entities_empty(VALUE self)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+
+  return lazy_block_count(lazy, ref->type) ? Qfalse : Qtrue;
+}
+
+static VALUE lazy_entities_aref(VALUE self, VALUE index)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+  long size = (long)lazy_block_count(lazy, ref->type);
+  long i = NUM2LONG(index);
+
+  if(i < 0)
+    i += size;
+
+  if(i < 0 || i >= size)
+    return Qnil;
+
+  return lazy_ref_new(lazy_entity_class, ref->block, ref->type, (size_t)i);
+}
+
+static VALUE lazy_entities_each(VALUE self)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+  size_t i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, lazy_entities_enum_size);
+
+  for(i = 0; i < lazy_block_count(lazy, ref->type); i++)
+    rb_yield(lazy_ref_new(lazy_entity_class, ref->block, ref->type, i));
+
+  return self;
+}
+
+static VALUE lazy_entities_inspect(VALUE self)
+{
+  return rb_sprintf("#<%"PRIsVALUE" size=%"PRIsVALUE">", rb_class_name(CLASS_OF(self)), lazy_entities_size(self));
+}
+
+// Field `field` of a lazy entity, nil if the entity doesn't have it
+static VALUE lazy_entity_field(pbf_lazy_block_t *lazy, pbf_lazy_ref_t *ref, int field)
+{
+  const pbf_convert_t *convert = &lazy->convert;
+  OSMPBF__Info dense_info_out, *info = NULL;
+
+  switch(ref->type)
+  {
+    case BLOB_HAS_NODES:
+    {
+      pbf_lazy_node_t *node = &lazy->nodes[ref->index];
+
+      if(node->node)
+      {
+        switch(field)
+        {
+          case FIELD_ID:
+            return LL2NUM(node->node->id);
+          case FIELD_LAT:
+            return coordinate_new(convert, convert->lat_offset, node->node->lat);
+          case FIELD_LON:
+            return coordinate_new(convert, convert->lon_offset, node->node->lon);
+          case FIELD_TAGS:
+            return tags_new(convert, node->node->n_keys, node->node->keys, node->node->vals);
+        }
+
+        info = node->node->info;
+      }
+      else
+      {
+        switch(field)
+        {
+          case FIELD_ID:
+            return LL2NUM(node->cursor.id);
+          case FIELD_LAT:
+            return coordinate_new(convert, convert->lat_offset, node->cursor.lat);
+          case FIELD_LON:
+            return coordinate_new(convert, convert->lon_offset, node->cursor.lon);
+          case FIELD_TAGS:
+            return dense_tags_new(node->dense, &node->cursor, convert);
+        }
+
+        if(node->dense->denseinfo)
+        {
+          dense_info(&node->cursor, &dense_info_out);
+          info = &dense_info_out;
+        }
+      }
+      break;
+    }
+
+    case BLOB_HAS_WAYS:
+    {
+      OSMPBF__Way *way = lazy->ways[ref->index];
+
+      switch(field)
+      {
+        case FIELD_ID:
+          return LL2NUM(way->id);
+        case FIELD_TAGS:
+          return tags_new(convert, way->n_keys, way->keys, way->vals);
+        case FIELD_REFS:
+          return refs_new(way, convert);
+      }
+
+      info = way->info;
+      break;
+    }
+
+    case BLOB_HAS_RELATIONS:
+    {
+      OSMPBF__Relation *relation = lazy->relations[ref->index];
+
+      switch(field)
+      {
+        case FIELD_ID:
+          return LL2NUM(relation->id);
+        case FIELD_TAGS:
+          return tags_new(convert, relation->n_keys, relation->keys, relation->vals);
+        case FIELD_MEMBERS:
+          return members_new(relation, convert);
+      }
+
+      info = relation->info;
+      break;
+    }
+  }
+
+  if(info && (field & FIELD_INFO))
+    return info_field(info, convert, field);
+
+  return Qnil;
+}
+
+static VALUE lazy_entity_get(VALUE self, int field)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+
+  return lazy_entity_field(lazy, ref, field);
+}
+
+static VALUE lazy_entity_id(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_ID);
+}
+
+static VALUE lazy_entity_lat(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_LAT);
+}
+
+static VALUE lazy_entity_lon(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_LON);
+}
+
+static VALUE lazy_entity_version(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_VERSION);
+}
+
+static VALUE lazy_entity_timestamp(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_TIMESTAMP);
+}
+
+static VALUE lazy_entity_changeset(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_CHANGESET);
+}
+
+static VALUE lazy_entity_uid(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_UID);
+}
+
+static VALUE lazy_entity_user(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_USER);
+}
+
+static VALUE lazy_entity_tags(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_TAGS);
+}
+
+static VALUE lazy_entity_refs(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_REFS);
+}
+
+static VALUE lazy_entity_members(VALUE self)
+{
+  return lazy_entity_get(self, FIELD_MEMBERS);
+}
+
+static VALUE lazy_entity_type(VALUE self)
+{
+  pbf_lazy_ref_t *ref = rb_check_typeddata(self, &lazy_ref_type);
+
+  switch(ref->type)
+  {
+    case BLOB_HAS_NODES:
+      return sym_node;
+    case BLOB_HAS_WAYS:
+      return sym_way;
+    default:
+      return sym_relation;
+  }
+}
+
+// Whether string `sid` of the block has the bytes of `key`
+static int lazy_sid_equal(const pbf_convert_t *convert, uint32_t sid, VALUE key)
+{
+  ProtobufCBinaryData *bstr;
+
+  if(sid >= convert->string_table->n_s)
+    return 0;
+
+  bstr = &convert->string_table->s[sid];
+
+  return bstr->len == (size_t)RSTRING_LEN(key) && !memcmp(bstr->data, RSTRING_PTR(key), bstr->len);
+}
+
+// Value of one tag, found in the block without building the tags hash
+static VALUE lazy_entity_tag(VALUE self, VALUE key)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+  const pbf_convert_t *convert = &lazy->convert;
+  size_t n_keys = 0, j;
+  uint32_t *keys = NULL, *vals = NULL;
+
+  StringValue(key);
+
+  switch(ref->type)
+  {
+    case BLOB_HAS_NODES:
+    {
+      pbf_lazy_node_t *node = &lazy->nodes[ref->index];
+
+      if(!node->node)
+      {
+        OSMPBF__DenseNodes *dense = node->dense;
+
+        for(j = node->cursor.tags; j + 1 < dense->n_keys_vals && dense->keys_vals[j] != 0; j += 2)
+          if(lazy_sid_equal(convert, dense->keys_vals[j], key))
+            return string_table_get(convert, dense->keys_vals[j+1]);
+
+        return Qnil;
+      }
+
+      n_keys = node->node->n_keys;
+      keys   = node->node->keys;
+      vals   = node->node->vals;
+      break;
+    }
+
+    case BLOB_HAS_WAYS:
+      n_keys = lazy->ways[ref->index]->n_keys;
+      keys   = lazy->ways[ref->index]->keys;
+      vals   = lazy->ways[ref->index]->vals;
+      break;
+
+    case BLOB_HAS_RELATIONS:
+      n_keys = lazy->relations[ref->index]->n_keys;
+      keys   = lazy->relations[ref->index]->keys;
+      vals   = lazy->relations[ref->index]->vals;
+      break;
+  }
+
+  for(j = 0; j < n_keys; j++)
+    if(lazy_sid_equal(convert, keys[j], key))
+      return string_table_get(convert, vals[j]);
+
+  return Qnil;
+}
+
+// The fields: option of the entity's type
+static int lazy_entity_fields(pbf_lazy_block_t *lazy, pbf_lazy_ref_t *ref)
+{
+  switch(ref->type)
+  {
+    case BLOB_HAS_NODES:
+      return lazy->convert.node_fields;
+    case BLOB_HAS_WAYS:
+      return lazy->convert.way_fields;
+    default:
+      return lazy->convert.relation_fields;
+  }
+}
+
+// Hash-like access, a field left out by fields: is nil like a missing key
+static VALUE lazy_entity_aref(VALUE self, VALUE name)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+  int field = field_from_name(name);
+
+  if(!(field & lazy_entity_fields(lazy, ref)))
+    return Qnil;
+
+  return lazy_entity_field(lazy, ref, field);
+}
+
+// The hash the entity would have been without lazy:
+static VALUE lazy_entity_to_h(VALUE self)
+{
+  pbf_lazy_block_t *lazy;
+  pbf_lazy_ref_t *ref = lazy_ref_get(self, &lazy);
+
+  switch(ref->type)
+  {
+    case BLOB_HAS_NODES:
+    {
+      pbf_lazy_node_t *node = &lazy->nodes[ref->index];
+
+      if(node->node)
+        return node_new(node->node, &lazy->convert);
+
+      return dense_node_new(node->dense, &node->cursor, &lazy->convert);
+    }
+
+    case BLOB_HAS_WAYS:
+      return way_new(lazy->ways[ref->index], &lazy->convert);
+
+    default:
+      return relation_new(lazy->relations[ref->index], &lazy->convert);
+  }
+}
+
+static VALUE lazy_entity_inspect(VALUE self)
+{
+  return rb_sprintf("#<%"PRIsVALUE" %"PRIsVALUE" %"PRIsVALUE">", rb_class_name(CLASS_OF(self)), rb_sym2str(lazy_entity_type(self)), lazy_entity_id(self));
+}
+
+/*
+  Convert an unpacked PrimitiveBlock into the @data hash. Only the groups
+  holding one of `types` are converted, the other lists are left empty. With
+  node_columns: the nodes go to @nodes_columns instead. With lazy: the lists
+  are LazyEntities, and the block takes over the memory of `arena`.
+*/
+static void process_primitive_block(VALUE obj, OSMPBF__PrimitiveBlock *primitive_block, pbf_arena_t *arena, int types)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_convert_t convert;
+  VALUE columns = Qnil;
+
+  convert_init(&convert, parser, primitive_block);
+
+  if(parser->node_columns && (types & BLOB_HAS_NODES))
+  {
+    columns = nodes_columns_new(primitive_block, &convert);
+    types &= ~BLOB_HAS_NODES;
+  }
+
+  if(parser->lazy)
+  {
+    VALUE block = lazy_block_new(obj, primitive_block, arena, types);
+    VALUE data  = rb_hash_new();
+
+    rb_hash_aset(data, sym_nodes, lazy_ref_new(lazy_entities_class, block, BLOB_HAS_NODES, 0));
+    rb_hash_aset(data, sym_ways, lazy_ref_new(lazy_entities_class, block, BLOB_HAS_WAYS, 0));
+    rb_hash_aset(data, sym_relations, lazy_ref_new(lazy_entities_class, block, BLOB_HAS_RELATIONS, 0));
+
+    RB_GC_GUARD(convert.strings);
+
+    rb_iv_set(obj, "@data", data);
+    rb_iv_set(obj, "@nodes_columns", columns);
+    return;
+  }
+
+  VALUE data      = init_data_arr();
+  VALUE nodes     = rb_hash_aref(data, sym_nodes);
+  VALUE ways      = rb_hash_aref(data, sym_ways);
+  VALUE relations = rb_hash_aref(data, sym_relations);
+
+  size_t i = 0;
+
+  for(i = 0; i < primitive_block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *primitive_group = primitive_block->primitivegroup[i];
+
+    if(primitive_group->nodes && (types & BLOB_HAS_NODES))
+      process_nodes(nodes, primitive_group, &convert);
+
+    if(primitive_group->dense && (types & BLOB_HAS_NODES))
+      process_dense_nodes(nodes, primitive_group->dense, &convert);
+
+    if(primitive_group->ways && (types & BLOB_HAS_WAYS))
+      process_ways(ways, primitive_group, &convert);
+
+    if(primitive_group->relations && (types & BLOB_HAS_RELATIONS))
+      process_relations(relations, primitive_group, &convert);
+  }
+
+  RB_GC_GUARD(convert.strings);
+
+  rb_iv_set(obj, "@data", data);
+  rb_iv_set(obj, "@nodes_columns", columns);
+}
+
+static VALUE read_osm_data(VALUE obj, int types)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_decoder_t *decoder = &parser->decoder;
+  pbf_step_t step = { 0 };
+  long block_pos;
+
+  check_idle(parser);
+
+  // Drop whatever an interrupted block left behind
+  arena_reset(&decoder->arena);
+
+  block_pos = input_tell(&parser->input);
+  run_step(parser, read_primitive_block_step, &step);
+
+  if(step.block == NULL)
+  {
+    decoder_raise(decoder);
+
+    // EOF reached
+    return Qfalse;
+  }
+
+  process_primitive_block(obj, step.block, &decoder->arena, types);
+
+  // Release the unpacked block in one go
+  arena_reset(&decoder->arena);
+
+  // Increment position
+  rb_iv_set(obj, "@pos", INT2NUM(NUM2INT(rb_iv_get(obj, "@pos")) + 1));
+  parser->block_pos = block_pos;
+
+  return Qtrue;
+}
+
+static VALUE range_new(pbf_range_t *range)
+{
+  if (range->min > range->max)
+    return Qnil;
+
+  return rb_range_new(LL2NUM(range->min), LL2NUM(range->max), 0);
+}
+
+static void add_blob_summary(VALUE blob_info, pbf_blob_info_t *info)
+{
+  VALUE types = rb_ary_new();
+  VALUE ids   = rb_hash_new();
+  VALUE bbox  = Qnil;
+
+  if (info->flags & BLOB_HAS_NODES) {
+    rb_ary_push(types, sym_nodes);
+    rb_hash_aset(ids, sym_nodes, range_new(&info->node_ids));
+
+    bbox = rb_hash_new();
+    rb_hash_aset(bbox, sym_top,    rb_float_new(info->lat.max * NANO_DEGREE));
+    rb_hash_aset(bbox, sym_right,  rb_float_new(info->lon.max * NANO_DEGREE));
+    rb_hash_aset(bbox, sym_bottom, rb_float_new(info->lat.min * NANO_DEGREE));
+    rb_hash_aset(bbox, sym_left,   rb_float_new(info->lon.min * NANO_DEGREE));
+  }
+
+  if (info->flags & BLOB_HAS_WAYS) {
+    rb_ary_push(types, sym_ways);
+    rb_hash_aset(ids, sym_ways, range_new(&info->way_ids));
+  }
+
+  if (info->flags & BLOB_HAS_RELATIONS) {
+    rb_ary_push(types, sym_relations);
+    rb_hash_aset(ids, sym_relations, range_new(&info->relation_ids));
+  }
+
+  rb_hash_aset(blob_info, sym_types, types);
+  rb_hash_aset(blob_info, sym_ids, ids);
+  rb_hash_aset(blob_info, sym_bbox, bbox);
+  rb_hash_aset(blob_info, sym_timestamps, range_new(&info->timestamp));
+}
+
+// Find position and size of all data blobs in the file
+static VALUE find_all_blobs(VALUE obj)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_index_t *index = index_get(parser);
+  size_t i;
+
+  VALUE blobs = rb_ary_new2(index->n_blobs);
+
+  for (i = 0; i < index->n_blobs; i++) {
+    VALUE blob_info = rb_hash_new();
+
+    // This is designed to be user-friendly, so I have chosen
+    // to make header_pos the position of the protobuf stream
+    // itself, in line with data_pos. However, internally, we
+    // subtract 4 when calling parse_osm_data().
+    rb_hash_aset(blob_info, sym_header_pos,
+		 LONG2NUM(index->blobs[i].header_pos));
+    rb_hash_aset(blob_info, sym_header_size,
+		 LONG2NUM(index->blobs[i].header_size));
+    rb_hash_aset(blob_info, sym_data_pos,
+		 LONG2NUM(index->blobs[i].data_pos));
+    rb_hash_aset(blob_info, sym_data_size,
+		 SIZET2NUM(index->blobs[i].data_size));
+
+    // Contents of the block, once #build_index has seen it
+    if (index->blobs[i].flags & BLOB_INDEXED)
+      add_blob_summary(blob_info, &index->blobs[i]);
+
+    rb_ary_push(blobs, blob_info);
+  }
+
+  rb_iv_set(obj, "@blobs", blobs);
+
+  return blobs;
+}
+
+static VALUE header_getter(VALUE obj)
+{
+  return rb_iv_get(obj, "@header");
+}
+
+static VALUE data_getter(VALUE obj)
+{
+  return rb_iv_get(obj, "@data");
+}
+
+static VALUE nodes_getter(VALUE obj)
+{
+  VALUE data = rb_iv_get(obj, "@data");
+
+  return rb_hash_aref(data, sym_nodes);
+}
+
+static VALUE nodes_columns_getter(VALUE obj)
+{
+  return rb_iv_get(obj, "@nodes_columns");
+}
+
+static VALUE ways_getter(VALUE obj)
+{
+  VALUE data = rb_iv_get(obj, "@data");
+
+  return rb_hash_aref(data, sym_ways);
+}
+
+static VALUE relations_getter(VALUE obj)
+{
+  VALUE data = rb_iv_get(obj, "@data");
+
+  return rb_hash_aref(data, sym_relations);
+}
+
+static VALUE blobs_getter(VALUE obj)
+{
+  VALUE blobs = rb_iv_get(obj, "@blobs");
+  if (blobs == Qnil) {
+      blobs = find_all_blobs(obj);
+  }
+  return blobs;
+}
+
+static VALUE size_getter(VALUE obj)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+
+  // Doesn't need the blob list as Ruby objects
+  return SIZET2NUM(index_get(parser)->n_blobs);
+}
+
+#ifdef PBF_USE_THREADS
+// Collect the blobs from `first` onwards that may hold `types` as jobs for the workers
+static pbf_job_t *build_jobs(VALUE obj, long first, int types, size_t *n_jobs)
+{
+  pbf_index_t *index = index_get(DATA_PTR(obj));
+  const unsigned char *blob_types = types != BLOB_ALL_TYPES ? get_blob_types(obj) : NULL;
+  long count = (long)index->n_blobs - first, i;
+  pbf_job_t *jobs;
+
+  if(!(jobs = calloc((count > 0 ? (size_t)count : 0) + 1, sizeof(pbf_job_t))))
+    rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob list");
+
+  *n_jobs = 0;
+
+  for(i = first; i < (long)index->n_blobs; i++)
+  {
+    if(blob_types && !(blob_types[i] & types))
+      continue;
+
+    jobs[*n_jobs].data_pos  = index->blobs[i].data_pos;
+    jobs[*n_jobs].data_size = index->blobs[i].data_size;
+    jobs[*n_jobs].blob      = i;
+    (*n_jobs)++;
+  }
+
+  return jobs;
+}
+
+static void read_ahead_stop(pbf_parser_t *parser)
+{
+  pipeline_stop(&parser->pipeline, 1);
+}
+
+/*
+  Take the next block from the read-ahead thread, starting it on the first
+  call after opening or seeking. It decodes up to `read_ahead` blocks past the
+  one being handed out while Ruby works on it.
+*/
+static VALUE read_osm_data_ahead(VALUE obj, int types)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_pipeline_t *pipeline = &parser->pipeline;
+  pbf_slot_t *slot;
+  long blob;
+
+  check_idle(parser);
+
+  // Blocks decoded ahead for other types are of no use
+  if(pipeline->slots && parser->read_ahead_types != types)
+    read_ahead_stop(parser);
+
+  if(!pipeline->slots)
+  {
+    size_t n_jobs;
+    pbf_job_t *jobs = build_jobs(obj, NUM2LONG(rb_iv_get(obj, "@pos")) + 1, types, &n_jobs);
+
+    pipeline_start(pipeline, &parser->input, jobs, n_jobs, 1, parser->read_ahead);
+    parser->read_ahead_types = types;
+  }
+
+  if(!(slot = pipeline_next(pipeline)))
+    return Qfalse;
+
+  if(!slot->block)
+  {
+    VALUE *error_class = slot->decoder.error_class;
+    const char *error = slot->decoder.error;
+
+    // Don't hand the failed slot out again, the next call starts over from that blob
+    read_ahead_stop(parser);
+
+    rb_raise(error ? *error_class : rb_eIOError, "%s", error ? error : "Unable to read the blob");
+  }
+
+  blob = pipeline->jobs[pipeline->next_result].blob;
+
+  process_primitive_block(obj, slot->block, &slot->decoder.arena, types);
+  pipeline_release(pipeline, slot);
+
+  rb_iv_set(obj, "@pos", LONG2NUM(blob));
+  parser->block_pos = parser->index.blobs[blob].header_pos - 4;
+
+  return Qtrue;
+}
+#endif
+
+/*
+  Move the input past the blobs that can't hold any of `types`, so that the
+  next one read is of interest. Returns 0 if none of the remaining blobs is.
+*/
+static int skip_blobs(VALUE obj, int types)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  const unsigned char *blob_types;
+  long pos = NUM2LONG(rb_iv_get(obj, "@pos")), blob;
+
+  if(types == BLOB_ALL_TYPES || !(blob_types = get_blob_types(obj)))
+    return 1;
+
+  for(blob = pos + 1; blob < (long)parser->index.n_blobs && !(blob_types[blob] & types); blob++);
+
+  if(blob >= (long)parser->index.n_blobs)
+    return 0;
+
+  if(blob != pos + 1)
+  {
+    check_idle(parser);
+
+    if(0 != input_seek(&parser->input, parser->index.blobs[blob].header_pos - 4, SEEK_SET))
+      rb_raise(rb_eIOError, "Unable to seek to file position");
+
+    rb_iv_set(obj, "@pos", LONG2NUM(blob - 1));
+  }
+
+  return 1;
+}
+
+// Move on to the next block that may hold one of `types`
+static VALUE parse_osm_data(VALUE obj, int types)
+{
+#ifdef PBF_USE_THREADS
+  pbf_parser_t *parser = DATA_PTR(obj);
+
+  if(parser->read_ahead > 0)
+    return read_osm_data_ahead(obj, types);
+#endif
+
+  if(!skip_blobs(obj, types))
+    return Qfalse;
+
+  return read_osm_data(obj, types);
+}
+
+static VALUE next_block(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE options;
+
+  rb_scan_args(argc, argv, ":", &options);
+
+  return parse_osm_data(obj, option_types(obj, options));
+}
+
+// Memory retained by the parser between blocks, for sizing purposes
+static VALUE stats_getter(VALUE obj)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_decoder_t *decoder = &parser->decoder;
+  VALUE stats = rb_hash_new();
+  size_t buffers = decoder->compressed.size + decoder->raw.size;
+  size_t arena_peak = decoder->arena.peak, arena_size = decoder->arena.capacity + decoder->scratch.capacity;
+
+#ifdef PBF_USE_THREADS
+  size_t i;
+
+  // Read-ahead slots have decoders of their own
+  for(i = 0; parser->pipeline.slots && i < parser->pipeline.n_slots; i++)
+  {
+    pbf_decoder_t *slot = &parser->pipeline.slots[i].decoder;
+
+    buffers    += slot->compressed.size + slot->raw.size;
+    arena_size += slot->arena.capacity + slot->scratch.capacity;
+
+    if(slot->arena.peak > arena_peak)
+      arena_peak = slot->arena.peak;
+  }
+#endif
+
+  // Buffers only ever grow, so their current size is also their peak
+  rb_hash_aset(stats, sym_buffer_peak, SIZET2NUM(buffers));
+
+  // Largest amount of unpacked protobuf data held for a single block
+  rb_hash_aset(stats, sym_arena_peak, SIZET2NUM(arena_peak));
+  rb_hash_aset(stats, sym_arena_size, SIZET2NUM(arena_size));
+
+  // Strings held by the cache shared by the blocks, and how often it had them
+  rb_hash_aset(stats, sym_string_cache_size, SIZET2NUM(parser->strings.size));
+  rb_hash_aset(stats, sym_string_cache_hits, SIZET2NUM(parser->strings.hits));
+  rb_hash_aset(stats, sym_string_cache_misses, SIZET2NUM(parser->strings.misses));
+
+  return stats;
+}
+
+static VALUE pos_getter(VALUE obj)
+{
+  return rb_iv_get(obj, "@pos");
+}
+
+static VALUE seek_to_osm_data(VALUE obj, VALUE index)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_index_t *blobs = index_get(parser);
+  int index_raw = NUM2INT(index);
+
+  // Normalise the index, otherwise #pos returns the wrong value
+  if (index_raw < 0) {
+    int size = (int)blobs->n_blobs;
+    // Only normalise if valid; otherwise, fail below.
+    if (index_raw + size >= 0) {
+        index_raw += size;
+    }
+  }
+
+  if (NUM2INT(rb_iv_get(obj, "@pos")) == index_raw) {
+    return Qtrue; // already there
+  }
+  if (index_raw < 0 || (size_t)index_raw >= blobs->n_blobs) {
+    return Qfalse; // no such blob entry
+  }
+  long pos = blobs->blobs[index_raw].header_pos - 4;
+  check_idle(parser);
+#ifdef PBF_USE_THREADS
+  read_ahead_stop(parser); // restarted from the new position
+#endif
+  if (0 != input_seek(&parser->input, pos, SEEK_SET)) {
+    rb_raise(rb_eIOError, "Unable to seek to file position");
+  }
+
+  // Set position - incremented by read_osm_data
+  rb_iv_set(obj, "@pos", INT2NUM(index_raw - 1));
+
+  // The block asked for, even if it holds none of the parser's types
+  return read_osm_data(obj, parser->types);
+}
+
+/*
+  Find the blob holding an entity, converting the entity into `entity`. Sorted
+  files are binary searched, decoding O(log n) blocks at most. Otherwise the
+  blobs are tried in order, skipping those whose indexed ID range rules them
+  out. Returns -1 if there is no such entity.
+*/
+static long locate_entity(VALUE obj, int type, int64_t id, VALUE *entity)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_index_t *index = index_get(parser);
+  long blob;
+
+  check_idle(parser);
+
+  if(header_has_feature(obj, "Sort.Type_then_ID"))
+  {
+    if((blob = search_sorted(parser, type, id, 0, NULL, NULL)) < 0)
+      return -1;
+
+    *entity = block_find(parser, read_block_at(parser, blob), type, id);
+    arena_reset(&parser->decoder.arena);
+
+    return NIL_P(*entity) ? -1 : blob;
+  }
+
+  for(blob = 0; blob < (long)index->n_blobs; blob++)
+  {
+    if(blob_excludes(&index->blobs[blob], type, id))
+      continue;
+
+    *entity = block_find(parser, read_block_at(parser, blob), type, id);
+    arena_reset(&parser->decoder.arena);
+
+    if(!NIL_P(*entity))
+      return blob;
+  }
+
+  return -1;
+}
+
+// Seek to the block holding an entity, false if there is none
+static VALUE seek_to_entity(VALUE obj, int type, VALUE id)
+{
+  VALUE entity;
+  long blob = locate_entity(obj, type, NUM2LL(id), &entity);
+
+  if(blob < 0)
+    return Qfalse;
+
+  seek_to_osm_data(obj, LONG2NUM(blob));
+
+  return Qtrue;
+}
+
+static VALUE seek_node(VALUE obj, VALUE id)
+{
+  return seek_to_entity(obj, BLOB_HAS_NODES, id);
+}
+
+static VALUE seek_way(VALUE obj, VALUE id)
+{
+  return seek_to_entity(obj, BLOB_HAS_WAYS, id);
+}
+
+static VALUE seek_relation(VALUE obj, VALUE id)
+{
+  return seek_to_entity(obj, BLOB_HAS_RELATIONS, id);
+}
+
+// The entity with the given ID, or nil. Only that entity is converted.
+static VALUE find_entity(VALUE obj, int type, VALUE id)
+{
+  VALUE entity = Qnil;
+
+  locate_entity(obj, type, NUM2LL(id), &entity);
+
+  return entity;
+}
+
+static VALUE find_node(VALUE obj, VALUE id)
+{
+  return find_entity(obj, BLOB_HAS_NODES, id);
+}
+
+static VALUE find_way(VALUE obj, VALUE id)
+{
+  return find_entity(obj, BLOB_HAS_WAYS, id);
+}
+
+static VALUE find_relation(VALUE obj, VALUE id)
+{
+  return find_entity(obj, BLOB_HAS_RELATIONS, id);
+}
+
+static VALUE iterate(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE options;
+  int types;
+
+#ifdef RB_PASS_CALLED_KEYWORDS
+  RETURN_ENUMERATOR_KW(obj, argc, argv, RB_PASS_CALLED_KEYWORDS);
+#else
+  RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+
+  rb_scan_args(argc, argv, ":", &options);
+
+  types = option_types(obj, options);
+
+  do
+  {
+    VALUE nodes     = nodes_getter(obj);
+    VALUE ways      = ways_getter(obj);
+    VALUE relations = relations_getter(obj);
+
+    rb_yield_values(3, nodes, ways, relations);
+
+  } while(RTEST(parse_osm_data(obj, types)));
+
+  return Qnil;
+}
+
+// State of #each_entity and the like, see stream_entities
+typedef struct {
+  VALUE obj;
+  int types;
+  pbf_arena_t arena; // the block being yielded, out of reach of the parser's other methods
+  // Handlers of #apply instead of the caller's block, with the types each one takes
+  const VALUE *handlers;
+  int *handler_types;
+  long n_handlers;
+} pbf_stream_t;
+
+// Yield an entity, or pass it to the handlers taking its type
+static void stream_emit(pbf_stream_t *stream, int type, VALUE entity)
+{
+  ID method = type == BLOB_HAS_NODES ? id_node : type == BLOB_HAS_WAYS ? id_way : id_relation;
+  long i;
+
+  if(!stream->handlers)
+  {
+    rb_yield(entity);
+    return;
+  }
+
+  for(i = 0; i < stream->n_handlers; i++)
+    if(stream->handler_types[i] & type)
+      rb_funcallv(stream->handlers[i], method, 1, &entity);
+}
+
+// Emit the entities of the stream's types in a block one by one, in the order #each lists them
+static void stream_primitive_block(pbf_stream_t *stream, pbf_parser_t *parser, OSMPBF__PrimitiveBlock *primitive_block)
+{
+  int types = stream->types;
+  pbf_convert_t convert;
+  size_t i, j;
+
+  convert_init(&convert, parser, primitive_block);
+
+  for(i = 0; i < primitive_block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = primitive_block->primitivegroup[i];
+
+    if(types & BLOB_HAS_NODES)
+    {
+      for(j = 0; j < group->n_nodes; j++)
+        stream_emit(stream, BLOB_HAS_NODES, node_new(group->nodes[j], &convert));
+
+      if(group->dense)
+      {
+        pbf_dense_cursor_t cursor = { 0 };
+
+        while(cursor.i < group->dense->n_id)
+        {
+          dense_next(group->dense, &cursor);
+          stream_emit(stream, BLOB_HAS_NODES, dense_node_new(group->dense, &cursor, &convert));
+        }
+      }
+    }
+
+    if(types & BLOB_HAS_WAYS)
+      for(j = 0; j < group->n_ways; j++)
+        stream_emit(stream, BLOB_HAS_WAYS, way_new(group->ways[j], &convert));
+
+    if(types & BLOB_HAS_RELATIONS)
+      for(j = 0; j < group->n_relations; j++)
+        stream_emit(stream, BLOB_HAS_RELATIONS, relation_new(group->relations[j], &convert));
+  }
+
+  RB_GC_GUARD(convert.strings);
+}
+
+// Drop the block being yielded, handing its memory back to the decoder for the next one
+static void stream_release(pbf_parser_t *parser, pbf_stream_t *stream)
+{
+  pbf_decoder_t *decoder = &parser->decoder;
+
+  if(!stream->arena.chunks)
+    return;
+
+  // Another thread is decoding with the parser's arena, leave it alone
+  if(parser->busy)
+  {
+    arena_release(&stream->arena);
+    return;
+  }
+
+  arena_release(&decoder->arena);
+  arena_move(&stream->arena, &decoder->arena);
+  arena_reset(&decoder->arena);
+}
+
+static VALUE stream_body(VALUE arg)
+{
+  pbf_stream_t *stream = (pbf_stream_t *)arg;
+  VALUE obj = stream->obj;
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_decoder_t *decoder = &parser->decoder;
+
+  for(;;)
+  {
+    pbf_step_t step = { 0 };
+    long block_pos;
+
+    check_idle(parser);
+
+    if(!skip_blobs(obj, stream->types))
+      break;
+
+    arena_reset(&decoder->arena);
+    block_pos = input_tell(&parser->input);
+    run_step(parser, read_primitive_block_step, &step);
+
+    if(step.block == NULL)
+    {
+      decoder_raise(decoder);
+
+      // EOF reached
+      break;
+    }
+
+    rb_iv_set(obj, "@pos", LONG2NUM(NUM2LONG(rb_iv_get(obj, "@pos")) + 1));
+    parser->block_pos = block_pos;
+
+    // The caller's block may seek or read with the parser meanwhile
+    arena_move(&decoder->arena, &stream->arena);
+    stream_primitive_block(stream, parser, step.block);
+    stream_release(parser, stream);
+  }
+
+  return Qnil;
+}
+
+static VALUE stream_ensure(VALUE arg)
+{
+  pbf_stream_t *stream = (pbf_stream_t *)arg;
+
+  // A break leaves the block it came from unpacked
+  stream_release(DATA_PTR(stream->obj), stream);
+
+  return Qnil;
+}
+
+/*
+  Yield the entities of `types` one at a time, from the current block to the
+  end of the file. Blocks are unpacked one after the other and never turned
+  into arrays, so #nodes, #ways and #relations are left empty. #next carries
+  on after the last block entities came from.
+*/
+static VALUE stream_entities(VALUE obj, pbf_stream_t *stream)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  long pos = NUM2LONG(rb_iv_get(obj, "@pos"));
+
+  check_idle(parser);
+
+#ifdef PBF_USE_THREADS
+  // The read-ahead thread restarts after the last block streamed here
+  read_ahead_stop(parser);
+#endif
+
+  // The current block is already converted, but as whole arrays: read it again
+  if(pos >= 0)
+  {
+    if(0 != input_seek(&parser->input, parser->block_pos, SEEK_SET))
+      rb_raise(rb_eIOError, "Unable to seek to file position");
+
+    rb_iv_set(obj, "@pos", LONG2NUM(pos - 1));
+  }
+
+  rb_iv_set(obj, "@data", init_data_arr());
+  rb_iv_set(obj, "@nodes_columns", Qnil);
+
+  stream->obj = obj;
+
+  return rb_ensure(stream_body, (VALUE)stream, stream_ensure, (VALUE)stream);
+}
+
+static VALUE stream_types(VALUE obj, int types)
+{
+  pbf_stream_t stream;
+
+  memset(&stream, 0, sizeof(stream));
+  stream.types = types;
+
+  return stream_entities(obj, &stream);
+}
+
+static VALUE each_entity(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE options;
+
+#ifdef RB_PASS_CALLED_KEYWORDS
+  RETURN_ENUMERATOR_KW(obj, argc, argv, RB_PASS_CALLED_KEYWORDS);
+#else
+  RETURN_ENUMERATOR(obj, argc, argv);
+#endif
+
+  rb_scan_args(argc, argv, ":", &options);
+
+  return stream_types(obj, option_types(obj, options));
+}
+
+static VALUE each_node(VALUE obj)
+{
+  RETURN_ENUMERATOR(obj, 0, 0);
+
+  return stream_types(obj, BLOB_HAS_NODES);
+}
+
+static VALUE each_way(VALUE obj)
+{
+  RETURN_ENUMERATOR(obj, 0, 0);
+
+  return stream_types(obj, BLOB_HAS_WAYS);
+}
+
+static VALUE each_relation(VALUE obj)
+{
+  RETURN_ENUMERATOR(obj, 0, 0);
+
+  return stream_types(obj, BLOB_HAS_RELATIONS);
+}
+
+// Entity types a handler of #apply takes, by the node, way and relation methods it has
+static int handler_types(VALUE handler)
+{
+  int types = 0;
+
+  if(rb_respond_to(handler, id_node))
+    types |= BLOB_HAS_NODES;
+
+  if(rb_respond_to(handler, id_way))
+    types |= BLOB_HAS_WAYS;
+
+  if(rb_respond_to(handler, id_relation))
+    types |= BLOB_HAS_RELATIONS;
+
+  return types;
+}
+
+/*
+  Stream the entities to every handler in one pass, calling its node, way or
+  relation method. What a handler takes is looked up once per class, and types
+  no handler takes are neither converted nor, when possible, decoded.
+*/
+static VALUE apply(int argc, VALUE *argv, VALUE obj)
+{
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_stream_t stream;
+  VALUE types_buffer;
+  long i, j;
 
-  if(header_block->writingprogram)
-    writingprogram = str_new(header_block->writingprogram);
+  memset(&stream, 0, sizeof(stream));
 
-  if(header_block->source)
-    source = str_new(header_block->source);
+  // Left to the GC if a handler raises
+  stream.handlers      = argv;
+  stream.n_handlers    = argc;
+  stream.handler_types = ALLOCV_N(int, types_buffer, argc);
 
-  if(header_block->bbox)
+  for(i = 0; i < argc; i++)
   {
-    rb_hash_aset(bbox_hash, STR2SYM("top"),    rb_float_new(header_block->bbox->top * NANO_DEGREE));
-    rb_hash_aset(bbox_hash, STR2SYM("right"),  rb_float_new(header_block->bbox->right * NANO_DEGREE));
-    rb_hash_aset(bbox_hash, STR2SYM("bottom"), rb_float_new(header_block->bbox->bottom * NANO_DEGREE));
-    rb_hash_aset(bbox_hash, STR2SYM("left"),   rb_float_new(header_block->bbox->left * NANO_DEGREE));
+    for(j = 0; j < i && CLASS_OF(argv[j]) != CLASS_OF(argv[i]); j++);
+
+    stream.handler_types[i] = j < i ? stream.handler_types[j] : handler_types(argv[i]);
+    stream.types |= stream.handler_types[i];
   }
 
-  if(header_block->has_osmosis_replication_timestamp)
-    osmosis_replication_timestamp = ULL2NUM(header_block->osmosis_replication_timestamp);
+  stream.types &= parser->types;
 
-  if(header_block->has_osmosis_replication_sequence_number)
-    osmosis_replication_sequence_number = ULL2NUM(header_block->osmosis_replication_sequence_number);
+  // Nothing to hand out, the file needn't be read
+  if(stream.types)
+    stream_entities(obj, &stream);
 
-  if(header_block->osmosis_replication_base_url)
-    osmosis_replication_base_url = str_new(header_block->osmosis_replication_base_url);
+  ALLOCV_END(types_buffer);
 
-  rb_hash_aset(header_hash, str_new("bbox"), bbox_hash);
-  rb_hash_aset(header_hash, str_new("required_features"), required_features);
-  rb_hash_aset(header_hash, str_new("optional_features"), optional_features);
-  rb_hash_aset(header_hash, str_new("writing_program"), writingprogram);
-  rb_hash_aset(header_hash, str_new("source"), source);
-  rb_hash_aset(header_hash, str_new("osmosis_replication_timestamp"), osmosis_replication_timestamp);
-  rb_hash_aset(header_hash, str_new("osmosis_replication_sequence_number"), osmosis_replication_sequence_number);
-  rb_hash_aset(header_hash, str_new("osmosis_replication_base_url"), osmosis_replication_base_url);
+  return Qnil;
+}
 
-  rb_iv_set(obj, "@header", header_hash);
+#ifdef PBF_USE_THREADS
+typedef struct {
+  VALUE obj;
+  int types;
+  pbf_pipeline_t pipeline;
+} pbf_parallel_t;
+
+static int default_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
 
-  osmpbf__header_block__free_unpacked(header_block, NULL);
+  if(n > 0)
+    return (int)n;
+#endif
 
-  return 1;
+  return 4;
 }
 
-static void process_nodes(VALUE out, OSMPBF__PrimitiveGroup *group, OSMPBF__StringTable *string_table, int64_t lat_offset, int64_t lon_offset, int64_t granularity, int32_t ts_granularity)
+static VALUE parallel_iterate_body(VALUE arg)
 {
-  double lat = 0;
-  double lon = 0;
-  unsigned j = 0;
-  size_t i = 0;
+  pbf_parallel_t *parallel = (pbf_parallel_t *)arg;
+  pbf_pipeline_t *pipeline = &parallel->pipeline;
+  pbf_slot_t *slot;
+  VALUE obj = parallel->obj;
+  pbf_parser_t *parser = DATA_PTR(obj);
 
-  for(i = 0; i < group->n_nodes; i++)
+  // The current block is already parsed, hand it out while the workers start
+  rb_yield_values(3, nodes_getter(obj), ways_getter(obj), relations_getter(obj));
+
+  while((slot = pipeline_next(pipeline)))
   {
-    OSMPBF__Node *node = group->nodes[i];
-    VALUE node_out = rb_hash_new();
+    long pos = pipeline->jobs[pipeline->next_result].blob;
 
-    lat = NANO_DEGREE * (lat_offset + (node->lat * granularity));
-    lon = NANO_DEGREE * (lon_offset + (node->lon * granularity));
+    if(!slot->block)
+      decoder_raise(&slot->decoder);
 
-    rb_hash_aset(node_out, STR2SYM("id"), LL2NUM(node->id));
-    rb_hash_aset(node_out, STR2SYM("lat"), FIX7(rb_float_new(lat)));
-    rb_hash_aset(node_out, STR2SYM("lon"), FIX7(rb_float_new(lon)));
+    process_primitive_block(obj, slot->block, &slot->decoder.arena, parallel->types);
+    pipeline_release(pipeline, slot);
 
-    if(node->info)
-      add_info(node_out, node->info, string_table, ts_granularity);
+    rb_iv_set(obj, "@pos", LONG2NUM(pos));
+    parser->block_pos = parser->index.blobs[pos].header_pos - 4;
+    rb_yield_values(3, nodes_getter(obj), ways_getter(obj), relations_getter(obj));
+  }
 
-    VALUE tags = rb_hash_new();
+  return Qnil;
+}
 
-    for(j = 0; j < node->n_keys; j++)
-    {
-      char *key   = parse_binary_str(string_table->s[node->keys[j]]);
-      char *value = parse_binary_str(string_table->s[node->vals[j]]);
+static VALUE parallel_iterate_ensure(VALUE arg)
+{
+  pbf_parallel_t *parallel = (pbf_parallel_t *)arg;
+  pbf_parser_t *parser = DATA_PTR(parallel->obj);
+  long pos = NUM2LONG(rb_iv_get(parallel->obj, "@pos"));
 
-      rb_hash_aset(tags, str_new(key), str_new(value));
+  pipeline_stop(&parallel->pipeline, 1);
 
-      free(key);
-      free(value);
-    }
+  // Leave the input right after the last block handed out so #next carries on from there
+  if(pos >= 0 && (size_t)pos < parser->index.n_blobs)
+  {
+    pbf_blob_info_t *info = &parser->index.blobs[pos];
 
-    rb_hash_aset(node_out, STR2SYM("tags"), tags);
-    rb_ary_push(out, node_out);
+    input_seek(&parser->input, info->data_pos + (long)info->data_size, SEEK_SET);
   }
+
+  return Qnil;
 }
+#endif
 
-static void process_dense_nodes(VALUE out, OSMPBF__DenseNodes *dense_nodes, OSMPBF__StringTable *string_table, int64_t lat_offset, int64_t lon_offset, int64_t granularity, int32_t ts_granularity)
+/*
+  Like #each, but the blocks after the current one are read, decompressed and
+  unpacked by native threads while Ruby converts and yields them in order.
+*/
+static VALUE parallel_iterate(int argc, VALUE *argv, VALUE obj)
 {
-  uint64_t node_id = 0;
-  int64_t delta_lat = 0;
-  int64_t delta_lon = 0;
-  int64_t delta_timestamp = 0;
-  int64_t delta_changeset = 0;
-  int32_t delta_user_sid = 0;
-  int32_t delta_uid = 0;
-
-  double lat = 0;
-  double lon = 0;
-
-  unsigned j = 0;
-  size_t i = 0;
+  VALUE options;
 
-  for(i = 0; i < dense_nodes->n_id; i++)
-  {
-    VALUE node = rb_hash_new();
+#ifdef RB_PASS_CALLED_KEYWORDS
+  RETURN_ENUMERATOR_KW(obj, argc, argv, RB_PASS_CALLED_KEYWORDS);
+#else
+  RETURN_ENUMERATOR(obj, argc, argv);
+#endif
 
-    node_id   += dense_nodes->id[i];
-    delta_lat += dense_nodes->lat[i];
-    delta_lon += dense_nodes->lon[i];
+  rb_scan_args(argc, argv, ":", &options);
 
-    lat = NANO_DEGREE * (lat_offset + (delta_lat * granularity));
-    lon = NANO_DEGREE * (lon_offset + (delta_lon * granularity));
+#ifdef PBF_USE_THREADS
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_parallel_t parallel;
+  VALUE threads = NIL_P(options) ? Qnil : rb_hash_aref(options, sym_threads);
+  int n_threads = NIL_P(threads) ? default_threads() : NUM2INT(threads);
+  pbf_job_t *jobs;
+  size_t n_jobs;
 
-    rb_hash_aset(node, STR2SYM("id"), LL2NUM(node_id));
-    rb_hash_aset(node, STR2SYM("lat"), FIX7(rb_float_new(lat)));
-    rb_hash_aset(node, STR2SYM("lon"), FIX7(rb_float_new(lon)));
+  if(n_threads < 1)
+    rb_raise(rb_eArgError, "threads must be at least 1");
 
-    // Extract info
-    if(dense_nodes->denseinfo)
-    {
-      delta_timestamp += dense_nodes->denseinfo->timestamp[i];
-      delta_changeset += dense_nodes->denseinfo->changeset[i];
-      delta_user_sid  += dense_nodes->denseinfo->user_sid[i];
-      delta_uid       += dense_nodes->denseinfo->uid[i];
+  check_idle(parser);
 
-      OSMPBF__Info info = {
-        .version   = dense_nodes->denseinfo->version[i],
-        .timestamp = delta_timestamp,
-        .changeset = delta_changeset,
-        .user_sid  = delta_user_sid,
-        .uid       = delta_uid
-      };
+  // The read-ahead thread restarts after the last block handed out here
+  read_ahead_stop(parser);
 
-      add_info(node, &info, string_table, ts_granularity);
-    }
+  parallel.obj   = obj;
+  parallel.types = option_types(obj, options);
 
-    // Extract tags
-    VALUE tags = rb_hash_new();
+  jobs = build_jobs(obj, NUM2LONG(rb_iv_get(obj, "@pos")) + 1, parallel.types, &n_jobs);
 
-    if(j < dense_nodes->n_keys_vals)
-    {
-      while((dense_nodes->keys_vals[j] != 0) && (j < dense_nodes->n_keys_vals))
-      {
-        char *key   = parse_binary_str(string_table->s[dense_nodes->keys_vals[j]]);
-        char *value = parse_binary_str(string_table->s[dense_nodes->keys_vals[j+1]]);
+  // Two slots per thread keep every worker busy while Ruby catches up
+  pipeline_start(&parallel.pipeline, &parser->input, jobs, n_jobs, n_threads, 2 * (size_t)n_threads);
 
-        rb_hash_aset(tags, str_new(key), str_new(value));
+  return rb_ensure(parallel_iterate_body, (VALUE)&parallel, parallel_iterate_ensure, (VALUE)&parallel);
+#else
+  return iterate(argc, argv, obj);
+#endif
+}
 
-        free(key);
-        free(value);
+#ifdef PBF_USE_THREADS
+static VALUE build_index_body(VALUE arg)
+{
+  pbf_pipeline_t *pipeline = (pbf_pipeline_t *)arg;
+  pbf_slot_t *slot;
 
-        j += 2;
-      }
-      j += 1;
-    }
+  // Workers fill in the blob info, there is nothing to convert
+  while((slot = pipeline_next(pipeline)))
+  {
+    if(!slot->block)
+      decoder_raise(&slot->decoder);
 
-    rb_hash_aset(node, STR2SYM("tags"), tags);
-    rb_ary_push(out, node);
+    pipeline_release(pipeline, slot);
   }
+
+  return Qnil;
 }
 
-static void process_ways(VALUE out, OSMPBF__PrimitiveGroup *group, OSMPBF__StringTable *string_table, int32_t ts_granularity)
+static VALUE build_index_ensure(VALUE arg)
 {
-  unsigned j, k;
-  size_t i = 0;
+  pipeline_stop((pbf_pipeline_t *)arg, 1);
 
-  for(i = 0; i < group->n_ways; i++)
-  {
-    OSMPBF__Way *way = group->ways[i];
-    int64_t delta_refs = 0;
+  return Qnil;
+}
+#else
+// Decode the blobs one after the other on the calling thread
+static void build_index_serial(pbf_parser_t *parser)
+{
+  pbf_index_t *index = &parser->index;
+  pbf_input_t *input = &parser->input;
+  long old_pos;
+  pbf_step_t step = { 0 };
+  size_t i;
+
+  check_idle(parser);
 
-    VALUE way_out = rb_hash_new();
+  old_pos = input_tell(input);
 
-    rb_hash_aset(way_out, STR2SYM("id"), LL2NUM(way->id));
+  for(i = 0; i < index->n_blobs; i++)
+  {
+    if(index->blobs[i].flags & BLOB_INDEXED)
+      continue;
 
-    // Extract tags
-    VALUE tags = rb_hash_new();
+    arena_reset(&parser->decoder.arena);
 
-    for(j = 0; j < way->n_keys; j++)
-    {
-      char *key   = parse_binary_str(string_table->s[way->keys[j]]);
-      char *value = parse_binary_str(string_table->s[way->vals[j]]);
+    if(0 != input_seek(input, index->blobs[i].header_pos - 4, SEEK_SET))
+      rb_raise(rb_eIOError, "Unable to seek to file position");
 
-      rb_hash_aset(tags, str_new(key), str_new(value));
+    run_step(parser, read_primitive_block_step, &step);
 
-      free(key);
-      free(value);
-    }
+    if(!step.block)
+      break;
 
-    // Extract refs
-    VALUE refs = rb_ary_new();
+    block_summarize(step.block, &index->blobs[i]);
+  }
 
-    for(k = 0; k < way->n_refs; k++)
-    {
-      delta_refs += way->refs[k];
-      rb_ary_push(refs, LL2NUM(delta_refs));
-    }
+  arena_reset(&parser->decoder.arena);
 
-    // Extract info
-    if(way->info)
-      add_info(way_out, way->info, string_table, ts_granularity);
+  if (0 != input_seek(input, old_pos, SEEK_SET))
+    rb_raise(rb_eIOError, "Unable to restore old file position");
 
-    rb_hash_aset(way_out, STR2SYM("tags"), tags);
-    rb_hash_aset(way_out, STR2SYM("refs"), refs);
-    rb_ary_push(out, way_out);
-  }
+  if(i < index->n_blobs)
+    decoder_raise(&parser->decoder);
 }
+#endif
 
-static void process_relations(VALUE out, OSMPBF__PrimitiveGroup *group, OSMPBF__StringTable *string_table, int32_t ts_granularity)
+/*
+  Decode every OSMData block once to record what it contains in the blob
+  index (see #blobs), saving it if the parser keeps one on disk. Blocks that
+  are already indexed are skipped, so this is cheap for a saved index.
+*/
+static VALUE build_index(int argc, VALUE *argv, VALUE obj)
 {
-  unsigned j, k;
-  size_t i = 0;
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_index_t *index = index_get(parser);
+  VALUE options;
+  size_t i, pending = 0;
 
-  for(i = 0; i < group->n_relations; i++)
-  {
-    OSMPBF__Relation *relation = group->relations[i];
-    VALUE relation_out = rb_hash_new();
+  rb_scan_args(argc, argv, ":", &options);
 
-    rb_hash_aset(relation_out, STR2SYM("id"), LL2NUM(relation->id));
+  check_idle(parser);
 
-    // Extract tags
-    VALUE tags = rb_hash_new();
+  for(i = 0; i < index->n_blobs; i++)
+    if(!(index->blobs[i].flags & BLOB_INDEXED))
+      pending++;
 
-    for(j = 0; j < relation->n_keys; j++)
-    {
-      char *key   = parse_binary_str(string_table->s[relation->keys[j]]);
-      char *value = parse_binary_str(string_table->s[relation->vals[j]]);
+  if(pending == 0)
+    return blobs_getter(obj);
 
-      rb_hash_aset(tags, str_new(key), str_new(value));
+  // The blob info is about to be written to
+  index_own(index);
 
-      free(key);
-      free(value);
-    }
+#ifdef PBF_USE_THREADS
+  pbf_pipeline_t pipeline;
+  VALUE threads = NIL_P(options) ? Qnil : rb_hash_aref(options, sym_threads);
+  int n_threads = NIL_P(threads) ? default_threads() : NUM2INT(threads);
+  pbf_job_t *jobs;
+  size_t n_jobs = 0;
 
-    // Extract members
-    VALUE members   = rb_hash_new();
-    VALUE nodes     = rb_ary_new();
-    VALUE ways      = rb_ary_new();
-    VALUE relations = rb_ary_new();
+  if(n_threads < 1)
+    rb_raise(rb_eArgError, "threads must be at least 1");
 
-    int64_t delta_memids = 0;
-    char *role;
+  if(!(jobs = calloc(pending, sizeof(pbf_job_t))))
+    rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob list");
 
-    for(k = 0; k < relation->n_memids; k++)
-    {
-      VALUE member = rb_hash_new();
+  for(i = 0; i < index->n_blobs; i++)
+  {
+    if(index->blobs[i].flags & BLOB_INDEXED)
+      continue;
 
-      delta_memids += relation->memids[k];
+    jobs[n_jobs].data_pos  = index->blobs[i].data_pos;
+    jobs[n_jobs].data_size = index->blobs[i].data_size;
+    jobs[n_jobs].info      = &index->blobs[i];
+    n_jobs++;
+  }
 
-      rb_hash_aset(member, STR2SYM("id"), LL2NUM(delta_memids));
+  pipeline_start(&pipeline, &parser->input, jobs, n_jobs, n_threads, 2 * (size_t)n_threads);
+  rb_ensure(build_index_body, (VALUE)&pipeline, build_index_ensure, (VALUE)&pipeline);
+#else
+  build_index_serial(parser);
+#endif
 
-      if(relation->roles_sid[k])
-      {
-        role = parse_binary_str(string_table->s[relation->roles_sid[k]]);
-        rb_hash_aset(member, STR2SYM("role"), str_new(role));
-        free(role);
-      }
+  if(index->path)
+    index_save(index);
 
-      switch(relation->types[k])
-      {
-        case OSMPBF__RELATION__MEMBER_TYPE__NODE:
-          rb_ary_push(nodes, member);
-          break;
-        case OSMPBF__RELATION__MEMBER_TYPE__WAY:
-          rb_ary_push(ways, member);
-          break;
-        case OSMPBF__RELATION__MEMBER_TYPE__RELATION:
-          rb_ary_push(relations, member);
-          break;
-      }
-    }
+  // Rebuilt with the new information on the next #blobs
+  rb_iv_set(obj, "@blobs", Qnil);
 
-    rb_hash_aset(members, STR2SYM("nodes"), nodes);
-    rb_hash_aset(members, STR2SYM("ways"), ways);
-    rb_hash_aset(members, STR2SYM("relations"), relations);
+  free(parser->blob_types);
+  parser->blob_types       = NULL;
+  parser->blob_types_ready = 0;
 
-    // Extract info
-    if(relation->info)
-      add_info(relation_out, relation->info, string_table, ts_granularity);
+  return blobs_getter(obj);
+}
 
-    rb_hash_aset(relation_out, STR2SYM("tags"), tags);
-    rb_hash_aset(relation_out, STR2SYM("members"), members);
-    rb_ary_push(out, relation_out);
-  }
+static int compare_ids(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
 }
 
-static VALUE parse_osm_data(VALUE obj)
+// Position of the first ID not below `id`
+static size_t lower_bound(const int64_t *ids, size_t n_ids, int64_t id)
 {
-  FILE *input = DATA_PTR(obj);
-  OSMPBF__BlobHeader *header = read_blob_header(input);
+  size_t lo = 0, hi = n_ids;
 
-  if(header == NULL)
-    return Qfalse;
+  while(lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
 
-  if(strcmp("OSMData", header->type) != 0)
-    rb_raise(rb_eIOError, "OSMData not found");
+    if(ids[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-  void *blob = NULL;
-  size_t blob_length = 0, datasize = header->datasize;
-  OSMPBF__PrimitiveBlock *primitive_block = NULL;
+  return lo;
+}
 
-  osmpbf__blob_header__free_unpacked(header, NULL);
+static int entity_wanted(const int64_t *ids, size_t n_ids, int64_t id, VALUE found)
+{
+  return bsearch(&id, ids, n_ids, sizeof(int64_t), compare_ids) && NIL_P(rb_hash_aref(found, LL2NUM(id)));
+}
 
-  blob = read_blob(input, datasize, &blob_length);
-  primitive_block = osmpbf__primitive_block__unpack(NULL, blob_length, blob);
+// Convert the wanted entities of a block into `found`, keyed by ID
+static void block_collect(pbf_parser_t *parser, OSMPBF__PrimitiveBlock *block, int type, const int64_t *ids, size_t n_ids, VALUE found)
+{
+  pbf_convert_t convert;
+  size_t i, j;
 
-  free(blob);
+  convert_init(&convert, parser, block);
 
-  if(primitive_block == NULL)
-    rb_raise(rb_eIOError, "Unable to unpack the PrimitiveBlock");
+  for(i = 0; i < block->n_primitivegroup; i++)
+  {
+    OSMPBF__PrimitiveGroup *group = block->primitivegroup[i];
 
-  int64_t lat_offset, lon_offset, granularity;
-  int32_t ts_granularity;
+    if(type == BLOB_HAS_NODES)
+    {
+      for(j = 0; j < group->n_nodes; j++)
+        if(entity_wanted(ids, n_ids, group->nodes[j]->id, found))
+          rb_hash_aset(found, LL2NUM(group->nodes[j]->id), node_new(group->nodes[j], &convert));
 
-  lat_offset     = primitive_block->lat_offset;
-  lon_offset     = primitive_block->lon_offset;
-  granularity    = primitive_block->granularity;
-  ts_granularity = primitive_block->date_granularity;
+      if(group->dense)
+      {
+        pbf_dense_cursor_t cursor = { 0 };
 
-  OSMPBF__StringTable *string_table = primitive_block->stringtable;
+        while(cursor.i < group->dense->n_id)
+        {
+          dense_next(group->dense, &cursor);
 
-  VALUE data      = init_data_arr();
-  VALUE nodes     = rb_hash_aref(data, STR2SYM("nodes"));
-  VALUE ways      = rb_hash_aref(data, STR2SYM("ways"));
-  VALUE relations = rb_hash_aref(data, STR2SYM("relations"));
+          if(entity_wanted(ids, n_ids, cursor.id, found))
+            rb_hash_aset(found, LL2NUM(cursor.id), dense_node_new(group->dense, &cursor, &convert));
+        }
+      }
+    }
 
-  size_t i = 0;
+    if(type == BLOB_HAS_WAYS)
+      for(j = 0; j < group->n_ways; j++)
+        if(entity_wanted(ids, n_ids, group->ways[j]->id, found))
+          rb_hash_aset(found, LL2NUM(group->ways[j]->id), way_new(group->ways[j], &convert));
 
-  for(i = 0; i < primitive_block->n_primitivegroup; i++)
-  {
-    OSMPBF__PrimitiveGroup *primitive_group = primitive_block->primitivegroup[i];
+    if(type == BLOB_HAS_RELATIONS)
+      for(j = 0; j < group->n_relations; j++)
+        if(entity_wanted(ids, n_ids, group->relations[j]->id, found))
+          rb_hash_aset(found, LL2NUM(group->relations[j]->id), relation_new(group->relations[j], &convert));
+  }
 
-    if(primitive_group->nodes)
-      process_nodes(nodes, primitive_group, string_table, lat_offset, lon_offset, granularity, ts_granularity);
+  RB_GC_GUARD(convert.strings);
+}
 
-    if(primitive_group->dense)
-      process_dense_nodes(nodes, primitive_group->dense, string_table, lat_offset, lon_offset, granularity, ts_granularity);
+typedef struct {
+  pbf_parser_t *parser;
+  int type;
+  const int64_t *ids;
+  size_t n_ids;
+  VALUE found;
+  char *collected; // blobs already collected while searching
+#ifdef PBF_USE_THREADS
+  pbf_pipeline_t pipeline;
+#endif
+} pbf_fetch_t;
+
+// Collect from the blocks the binary search decodes, so they aren't decoded again
+static void fetch_probe(void *arg, size_t blob, OSMPBF__PrimitiveBlock *block)
+{
+  pbf_fetch_t *fetch = arg;
 
-    if(primitive_group->ways)
-      process_ways(ways, primitive_group, string_table, ts_granularity);
+  block_collect(fetch->parser, block, fetch->type, fetch->ids, fetch->n_ids, fetch->found);
+  fetch->collected[blob] = 1;
+}
 
-    if(primitive_group->relations)
-      process_relations(relations, primitive_group, string_table, ts_granularity);
-  }
+#ifdef PBF_USE_THREADS
+static VALUE fetch_body(VALUE arg)
+{
+  pbf_fetch_t *fetch = (pbf_fetch_t *)arg;
+  pbf_slot_t *slot;
 
-  rb_iv_set(obj, "@data", data);
+  while((slot = pipeline_next(&fetch->pipeline)))
+  {
+    if(!slot->block)
+      decoder_raise(&slot->decoder);
 
-  osmpbf__primitive_block__free_unpacked(primitive_block, NULL);
+    block_collect(fetch->parser, slot->block, fetch->type, fetch->ids, fetch->n_ids, fetch->found);
+    pipeline_release(&fetch->pipeline, slot);
+  }
 
-  // Increment position
-  rb_iv_set(obj, "@pos", INT2NUM(NUM2INT(rb_iv_get(obj, "@pos")) + 1));
+  return Qnil;
+}
 
-  return Qtrue;
+static VALUE fetch_ensure(VALUE arg)
+{
+  pipeline_stop(&((pbf_fetch_t *)arg)->pipeline, 1);
+
+  return Qnil;
 }
+#endif
 
-// Find position and size of all data blobs in the file
-static VALUE find_all_blobs(VALUE obj)
+/*
+  Look up many entities at once. The IDs are sorted and mapped to blobs, by
+  binary search for sorted files or by the indexed ID ranges otherwise, and
+  each blob that may hold some of them is decoded only once. Blocks the search
+  decodes are collected from right away, the others on the pipeline workers
+  when available. Returns the entities found, in ID order.
+*/
+static VALUE fetch_entities(int argc, VALUE *argv, VALUE obj, int type)
 {
-  FILE *input = DATA_PTR(obj);
-  long old_pos = ftell(input);
+  pbf_parser_t *parser = DATA_PTR(obj);
+  pbf_index_t *index = index_get(parser);
+  VALUE ids, options, result, ids_buf, touched_buf, collected_buf, cache_buf = 0;
+  pbf_fetch_t fetch;
+  int64_t *wanted;
+  char *touched, *collected;
+  size_t i, n_ids = 0, n_touched = 0;
+  long blob;
 
-  if (0 != fseek(input, 0, SEEK_SET)) {
-    rb_raise(rb_eIOError, "Unable to seek to beginning of file");
-  }
+  rb_scan_args(argc, argv, "1:", &ids, &options);
 
-  OSMPBF__BlobHeader *header;
+  ids = rb_Array(ids);
 
-  VALUE blobs = rb_ary_new();
-  rb_iv_set(obj, "@blobs", blobs);
+  check_idle(parser);
+
+  wanted = ALLOCV_N(int64_t, ids_buf, RARRAY_LEN(ids) + 1);
+
+  for(i = 0; i < (size_t)RARRAY_LEN(ids); i++)
+    wanted[i] = NUM2LL(rb_ary_entry(ids, i));
+
+  qsort(wanted, i, sizeof(int64_t), compare_ids);
+
+  // Drop duplicates
+  for(blob = 0; blob < (long)i; blob++)
+    if(n_ids == 0 || wanted[n_ids - 1] != wanted[blob])
+      wanted[n_ids++] = wanted[blob];
 
-  long pos = 0, data_pos = 0;
-  int32_t datasize;
+  touched = ALLOCV_N(char, touched_buf, index->n_blobs + 1);
+  memset(touched, 0, index->n_blobs + 1);
 
-  while ((header = read_blob_header(input)) != NULL) {
+  collected = ALLOCV_N(char, collected_buf, index->n_blobs + 1);
+  memset(collected, 0, index->n_blobs + 1);
 
-    datasize = header->datasize;
+  fetch.parser    = parser;
+  fetch.type      = type;
+  fetch.ids       = wanted;
+  fetch.n_ids     = n_ids;
+  fetch.found     = rb_hash_new();
+  fetch.collected = collected;
 
-    if (0 == strcmp(header->type, "OSMData")) {
-      VALUE blob_info = rb_hash_new();
-      data_pos = ftell(input);
+  if(header_has_feature(obj, "Sort.Type_then_ID"))
+  {
+    pbf_blob_info_t *cache = ALLOCV_N(pbf_blob_info_t, cache_buf, index->n_blobs + 1);
+    pbf_probe_t probe = { fetch_probe, &fetch };
+
+    memset(cache, 0, (index->n_blobs + 1) * sizeof(pbf_blob_info_t));
 
-      // This is designed to be user-friendly, so I have chosen
-      // to make header_pos the position of the protobuf stream
-      // itself, in line with data_pos. However, internally, we
-      // subtract 4 when calling parse_osm_data().
-      rb_hash_aset(blob_info, STR2SYM("header_pos"),
-		   LONG2NUM(pos + 4));
-      rb_hash_aset(blob_info, STR2SYM("header_size"),
-		   LONG2NUM(data_pos - pos - 4));
-      rb_hash_aset(blob_info, STR2SYM("data_pos"),
-		   LONG2NUM(data_pos));
-      rb_hash_aset(blob_info, STR2SYM("data_size"),
-		   UINT2NUM(datasize));
+    // IDs come in order, so each search starts from the previous blob
+    for(i = 0, blob = 0; i < n_ids; i++)
+    {
+      blob = search_sorted(parser, type, wanted[i], blob, cache, &probe);
 
-      rb_ary_push(blobs, blob_info);
+      if(blob < 0)
+        blob = 0;
+      else
+        touched[blob] = 1;
     }
+  }
+  else
+  {
+    for(blob = 0; blob < (long)index->n_blobs; blob++)
+    {
+      pbf_blob_info_t *info = &index->blobs[blob];
 
-    osmpbf__blob_header__free_unpacked(header, NULL);
+      if(!(info->flags & BLOB_INDEXED))
+        touched[blob] = 1;
+      else if(info->flags & type)
+      {
+        // First wanted ID not below the range, then check it's not above either
+        i = lower_bound(wanted, n_ids, blob_ids(info, type)->min);
 
-    if (0 != fseek(input, datasize, SEEK_CUR)) {
-      break; // cut losses
+        touched[blob] = i < n_ids && wanted[i] <= blob_ids(info, type)->max;
+      }
     }
-    pos = ftell(input);
   }
 
-  // restore old position
-  if (0 != fseek(input, old_pos, SEEK_SET)) {
-    rb_raise(rb_eIOError, "Unable to restore old file position");
+  // Blocks the search decoded are done already
+  for(blob = 0; blob < (long)index->n_blobs; blob++)
+  {
+    touched[blob] &= !collected[blob];
+    n_touched += touched[blob];
   }
 
-  return blobs;
-}
+  if(n_ids > 0 && n_touched > 0)
+  {
+#ifdef PBF_USE_THREADS
+    VALUE threads = NIL_P(options) ? Qnil : rb_hash_aref(options, sym_threads);
+    int n_threads = NIL_P(threads) ? default_threads() : NUM2INT(threads);
+    pbf_job_t *jobs;
+    size_t n_jobs = 0;
 
-static VALUE header_getter(VALUE obj)
-{
-  return rb_iv_get(obj, "@header");
-}
+    if(n_threads < 1)
+      rb_raise(rb_eArgError, "threads must be at least 1");
 
-static VALUE data_getter(VALUE obj)
-{
-  return rb_iv_get(obj, "@data");
-}
+    if((size_t)n_threads > n_touched)
+      n_threads = (int)n_touched;
 
-static VALUE nodes_getter(VALUE obj)
-{
-  VALUE data = rb_iv_get(obj, "@data");
+    if(!(jobs = calloc(n_touched, sizeof(pbf_job_t))))
+      rb_raise(rb_eNoMemError, "Unable to allocate memory for the blob list");
 
-  return rb_hash_aref(data, STR2SYM("nodes"));
-}
+    for(blob = 0; blob < (long)index->n_blobs; blob++)
+    {
+      if(!touched[blob])
+        continue;
 
-static VALUE ways_getter(VALUE obj)
-{
-  VALUE data = rb_iv_get(obj, "@data");
+      jobs[n_jobs].data_pos  = index->blobs[blob].data_pos;
+      jobs[n_jobs].data_size = index->blobs[blob].data_size;
+      n_jobs++;
+    }
 
-  return rb_hash_aref(data, STR2SYM("ways"));
-}
+    pipeline_start(&fetch.pipeline, &parser->input, jobs, n_jobs, n_threads, 2 * (size_t)n_threads);
+    rb_ensure(fetch_body, (VALUE)&fetch, fetch_ensure, (VALUE)&fetch);
+#else
+    for(blob = 0; blob < (long)index->n_blobs; blob++)
+    {
+      if(!touched[blob])
+        continue;
 
-static VALUE relations_getter(VALUE obj)
-{
-  VALUE data = rb_iv_get(obj, "@data");
+      block_collect(parser, read_block_at(parser, blob), type, wanted, n_ids, fetch.found);
+      arena_reset(&parser->decoder.arena);
+    }
+#endif
+  }
 
-  return rb_hash_aref(data, STR2SYM("relations"));
+  result = rb_ary_new();
+
+  for(i = 0; i < n_ids; i++)
+  {
+    VALUE entity = rb_hash_aref(fetch.found, LL2NUM(wanted[i]));
+
+    if(!NIL_P(entity))
+      rb_ary_push(result, entity);
+  }
+
+  ALLOCV_END(ids_buf);
+  ALLOCV_END(touched_buf);
+  ALLOCV_END(collected_buf);
+
+  if(cache_buf)
+    ALLOCV_END(cache_buf);
+
+  return result;
 }
 
-static VALUE blobs_getter(VALUE obj)
+static VALUE fetch_nodes(int argc, VALUE *argv, VALUE obj)
 {
-  VALUE blobs = rb_iv_get(obj, "@blobs");
-  if (blobs == Qnil) {
-      blobs = find_all_blobs(obj);
-  }
-  return blobs;
+  return fetch_entities(argc, argv, obj, BLOB_HAS_NODES);
 }
 
-static VALUE size_getter(VALUE obj)
+static VALUE fetch_ways(int argc, VALUE *argv, VALUE obj)
 {
-  VALUE blobs = blobs_getter(obj);
-  return rb_funcall(blobs, rb_intern("size"), 0);
+  return fetch_entities(argc, argv, obj, BLOB_HAS_WAYS);
 }
 
-static VALUE pos_getter(VALUE obj)
+static VALUE fetch_relations(int argc, VALUE *argv, VALUE obj)
 {
-  return rb_iv_get(obj, "@pos");
+  return fetch_entities(argc, argv, obj, BLOB_HAS_RELATIONS);
 }
 
-static VALUE seek_to_osm_data(VALUE obj, VALUE index)
+static VALUE initialize(int argc, VALUE *argv, VALUE obj)
 {
-  FILE *input = DATA_PTR(obj);
-  VALUE blobs = blobs_getter(obj);
-  int index_raw = NUM2INT(index);
+  VALUE filename, options, index = Qnil;
+  pbf_parser_t *parser = DATA_PTR(obj);
+  int use_mmap = 0;
 
-  // Normalise the index, otherwise #pos returns the wrong value
-  if (index_raw < 0) {
-    int size = NUM2INT(size_getter(obj));
-    // Only normalise if valid; otherwise, allow rb_ary_entry() to fail.
-    if (index_raw + size >= 0) {
-        index_raw += size;
-    }
-  }
+  rb_scan_args(argc, argv, "1:", &filename, &options);
 
-  if (NUM2INT(rb_iv_get(obj, "@pos")) == index_raw) {
-    return Qtrue; // already there
-  }
-  VALUE blob_info = rb_ary_entry(blobs, index_raw);
-  if (!RTEST(blob_info)) {
-    return Qfalse; // no such blob entry
-  }
-  long pos = NUM2LONG(rb_hash_aref(blob_info, STR2SYM("header_pos"))) - 4;
-  if (0 != fseek(input, pos, SEEK_SET)) {
-    rb_raise(rb_eIOError, "Unable to seek to file position");
-  }
+  // Check that filename is a string
+  Check_Type(filename, T_STRING);
 
-  // Set position - incremented by parse_osm_data
-  rb_iv_set(obj, "@pos", INT2NUM(index_raw - 1));
+  if(!NIL_P(options))
+  {
+    use_mmap = RTEST(rb_hash_aref(options, STR2SYM("mmap")));
+    index    = rb_hash_aref(options, STR2SYM("index"));
 
-  return parse_osm_data(obj);
-}
+    parser->types = parse_types(rb_hash_aref(options, sym_types));
 
-static VALUE iterate(VALUE obj)
-{
-  if (!rb_block_given_p())
-    return rb_funcall(obj, rb_intern("to_enum"), 0);
+    parse_fields(parser, rb_hash_aref(options, STR2SYM("fields")));
 
-  do
-  {
-    VALUE nodes     = nodes_getter(obj);
-    VALUE ways      = ways_getter(obj);
-    VALUE relations = relations_getter(obj);
+    parser->node_columns = RTEST(rb_hash_aref(options, STR2SYM("node_columns")));
+    parser->packed       = RTEST(rb_hash_aref(options, STR2SYM("packed")));
+    parser->lazy         = RTEST(rb_hash_aref(options, STR2SYM("lazy")));
+    parser->structs      = RTEST(rb_hash_aref(options, STR2SYM("structs")));
 
-    rb_yield_values(3, nodes, ways, relations);
+    VALUE coordinates = rb_hash_aref(options, STR2SYM("coordinates"));
 
-  } while(RTEST(parse_osm_data(obj)));
+    if(NIL_P(coordinates) || coordinates == STR2SYM("degrees"))
+      parser->coordinates = COORDINATES_DEGREES;
+    else if(coordinates == STR2SYM("nanodegrees"))
+      parser->coordinates = COORDINATES_NANODEGREES;
+    else if(coordinates == STR2SYM("e7"))
+      parser->coordinates = COORDINATES_E7;
+    else
+      rb_raise(rb_eArgError, "Unknown coordinates %+"PRIsVALUE, coordinates);
 
-  return Qnil;
-}
+    VALUE string_cache = rb_hash_aref(options, STR2SYM("string_cache"));
 
-static VALUE initialize(VALUE obj, VALUE filename)
-{
-  // Check that filename is a string
-  Check_Type(filename, T_STRING);
+    if(!NIL_P(string_cache))
+    {
+      long capacity = NUM2LONG(string_cache);
+
+      if(capacity < 0 || capacity >= STRING_CACHE_NONE)
+        rb_raise(rb_eArgError, "string_cache must be between 0 and %u", STRING_CACHE_NONE - 1);
+
+      string_cache_free(&parser->strings);
+      string_cache_init(&parser->strings, capacity);
+    }
+
+#ifdef PBF_USE_THREADS
+    VALUE read_ahead = rb_hash_aref(options, STR2SYM("read_ahead"));
+
+    if(!NIL_P(read_ahead) && (parser->read_ahead = NUM2INT(read_ahead)) < 0)
+      rb_raise(rb_eArgError, "read_ahead must not be negative");
+#endif
+  }
 
   // Try to open the given file
-  if(!(DATA_PTR(obj) = fopen(StringValuePtr(filename), "rb")))
+  if(!input_open(&parser->input, StringValueCStr(filename), use_mmap))
     rb_raise(rb_eIOError, "Unable to open the file");
 
   // Store the filename
@@ -773,19 +4747,69 @@ static VALUE initialize(VALUE obj, VALUE filename)
 
   // Every osm.pbf file must have an OSMHeader at the beginning.
   // Failing to find it means that the file is corrupt or invalid.
-  parse_osm_header(obj, DATA_PTR(obj));
+  parse_osm_header(obj, &parser->input, &parser->decoder);
 
-  // Parse the firts OSMData fileblock
-  parse_osm_data(obj);
+  // index: true keeps the blob index next to the file, a string gives its path
+  if(RTEST(index))
+  {
+    if(index == Qtrue)
+      index = rb_str_plus(filename, rb_str_new_cstr(".idx"));
+
+    index_init(&parser->index, StringValueCStr(index), StringValueCStr(filename), &parser->input, &parser->decoder.compressed, input_tell(&parser->input));
+  }
+
+  // Parse the firts OSMData fileblock. Read-ahead only kicks in from the next one,
+  // so opening a file doesn't require scanning it.
+  if(skip_blobs(obj, parser->types))
+    read_osm_data(obj, parser->types);
 
   return obj;
 }
 
-static VALUE alloc_file(VALUE klass)
+static void free_parser(pbf_parser_t *parser)
+{
+#ifdef PBF_USE_THREADS
+  // Workers read from the input, stop them before closing it
+  pipeline_stop(&parser->pipeline, 0);
+#endif
+
+  input_close(&parser->input);
+  decoder_free(&parser->decoder);
+  index_free(&parser->index);
+  string_cache_free(&parser->strings);
+  free(parser->blob_types);
+  free(parser);
+}
+
+static void mark_parser(pbf_parser_t *parser)
+{
+  string_cache_mark(&parser->strings);
+}
+
+static VALUE alloc_parser(VALUE klass)
 {
-  FILE *input = NULL;
+  pbf_parser_t *parser;
+
+  VALUE obj = Data_Make_Struct(klass, pbf_parser_t, mark_parser, free_parser, parser);
+
+  decoder_init(&parser->decoder);
+  parser->types = BLOB_ALL_TYPES;
+  parser->node_fields = FIELD_ALL;
+  parser->way_fields = FIELD_ALL;
+  parser->relation_fields = FIELD_ALL;
+  string_cache_init(&parser->strings, STRING_CACHE_SIZE);
 
-  return Data_Wrap_Struct(klass, NULL, fclose, input);
+  return obj;
+}
+
+// Library used to decompress zlib blobs, chosen when the extension was built
+static VALUE inflate_backend(VALUE klass)
+{
+#ifdef HAVE_LIBDEFLATE
+  return str_new("libdeflate");
+#else
+  return str_new("zlib");
+#endif
 }
 
 static VALUE inspect(VALUE obj)
@@ -798,21 +4822,140 @@ void Init_pbf_parser(void)
 {
   VALUE klass = rb_define_class("PbfParser", rb_cObject);
 
-  rb_define_alloc_func(klass, alloc_file);
-  rb_define_method(klass, "initialize", initialize, 1);
+  sym_id        = STR2SYM("id");
+  sym_lat       = STR2SYM("lat");
+  sym_lon       = STR2SYM("lon");
+  sym_version   = STR2SYM("version");
+  sym_timestamp = STR2SYM("timestamp");
+  sym_changeset = STR2SYM("changeset");
+  sym_uid       = STR2SYM("uid");
+  sym_user      = STR2SYM("user");
+  sym_tags      = STR2SYM("tags");
+  sym_refs      = STR2SYM("refs");
+  sym_members   = STR2SYM("members");
+  sym_role      = STR2SYM("role");
+  sym_nodes     = STR2SYM("nodes");
+  sym_ways      = STR2SYM("ways");
+  sym_relations = STR2SYM("relations");
+
+  sym_ids        = STR2SYM("ids");
+  sym_types      = STR2SYM("types");
+  sym_roles      = STR2SYM("roles");
+  sym_role_names = STR2SYM("role_names");
+
+  sym_node     = STR2SYM("node");
+  sym_way      = STR2SYM("way");
+  sym_relation = STR2SYM("relation");
+
+  sym_size        = STR2SYM("size");
+  sym_tag_offsets = STR2SYM("tag_offsets");
+  sym_tag_keys    = STR2SYM("tag_keys");
+  sym_tag_values  = STR2SYM("tag_values");
+  sym_threads     = STR2SYM("threads");
+
+  sym_top        = STR2SYM("top");
+  sym_right      = STR2SYM("right");
+  sym_bottom     = STR2SYM("bottom");
+  sym_left       = STR2SYM("left");
+  sym_bbox       = STR2SYM("bbox");
+  sym_timestamps = STR2SYM("timestamps");
+
+  sym_header_pos  = STR2SYM("header_pos");
+  sym_header_size = STR2SYM("header_size");
+  sym_data_pos    = STR2SYM("data_pos");
+  sym_data_size   = STR2SYM("data_size");
+
+  sym_buffer_peak         = STR2SYM("buffer_peak");
+  sym_arena_peak          = STR2SYM("arena_peak");
+  sym_arena_size          = STR2SYM("arena_size");
+  sym_string_cache_size   = STR2SYM("string_cache_size");
+  sym_string_cache_hits   = STR2SYM("string_cache_hits");
+  sym_string_cache_misses = STR2SYM("string_cache_misses");
+
+  rb_define_alloc_func(klass, alloc_parser);
+  rb_define_singleton_method(klass, "inflate_backend", inflate_backend, 0);
+  rb_define_method(klass, "initialize", initialize, -1);
   rb_define_method(klass, "inspect", inspect, 0);
-  rb_define_method(klass, "next", parse_osm_data, 0);
+  rb_define_method(klass, "next", next_block, -1);
   rb_define_method(klass, "seek", seek_to_osm_data, 1);
   rb_define_method(klass, "pos=", seek_to_osm_data, 1);
-  rb_define_method(klass, "each", iterate, 0);
+  rb_define_method(klass, "seek_node", seek_node, 1);
+  rb_define_method(klass, "seek_way", seek_way, 1);
+  rb_define_method(klass, "seek_relation", seek_relation, 1);
+  rb_define_method(klass, "find_node", find_node, 1);
+  rb_define_method(klass, "find_way", find_way, 1);
+  rb_define_method(klass, "find_relation", find_relation, 1);
+  rb_define_method(klass, "fetch_nodes", fetch_nodes, -1);
+  rb_define_method(klass, "fetch_ways", fetch_ways, -1);
+  rb_define_method(klass, "fetch_relations", fetch_relations, -1);
+  rb_define_method(klass, "each", iterate, -1);
+  rb_define_method(klass, "parallel_each", parallel_iterate, -1);
+  rb_define_method(klass, "each_entity", each_entity, -1);
+  rb_define_method(klass, "each_node", each_node, 0);
+  rb_define_method(klass, "each_way", each_way, 0);
+  rb_define_method(klass, "each_relation", each_relation, 0);
+  rb_define_method(klass, "apply", apply, -1);
+  rb_define_method(klass, "build_index", build_index, -1);
 
   // Getters
   rb_define_method(klass, "header", header_getter, 0);
   rb_define_method(klass, "data", data_getter, 0);
   rb_define_method(klass, "nodes", nodes_getter, 0);
+  rb_define_method(klass, "nodes_columns", nodes_columns_getter, 0);
   rb_define_method(klass, "ways", ways_getter, 0);
   rb_define_method(klass, "relations", relations_getter, 0);
   rb_define_method(klass, "blobs", blobs_getter, 0);
   rb_define_method(klass, "size", size_getter, 0);
   rb_define_method(klass, "pos", pos_getter, 0);
+  rb_define_method(klass, "stats", stats_getter, 0);
+
+  packed_ids_class = rb_define_class_under(klass, "PackedIds", rb_cObject);
+  rb_include_module(packed_ids_class, rb_mEnumerable);
+  rb_undef_alloc_func(packed_ids_class);
+  rb_define_method(packed_ids_class, "size", packed_ids_size, 0);
+  rb_define_method(packed_ids_class, "length", packed_ids_size, 0);
+  rb_define_method(packed_ids_class, "[]", packed_ids_aref, 1);
+  rb_define_method(packed_ids_class, "each", packed_ids_each, 0);
+  rb_define_method(packed_ids_class, "packed", packed_ids_packed, 0);
+  rb_define_method(packed_ids_class, "==", packed_ids_equal, 1);
+  rb_define_method(packed_ids_class, "inspect", packed_ids_inspect, 0);
+
+  id_node     = rb_intern("node");
+  id_way      = rb_intern("way");
+  id_relation = rb_intern("relation");
+  id_key_p    = rb_intern("key?");
+
+  // Members in the order of the hash keys, see NODE_* and ENTITY_*
+  node_class     = rb_struct_define_under(klass, "Node", "id", "lat", "lon", "version", "timestamp", "changeset", "uid", "user", "tags", NULL);
+  way_class      = rb_struct_define_under(klass, "Way", "id", "version", "timestamp", "changeset", "uid", "user", "tags", "refs", NULL);
+  relation_class = rb_struct_define_under(klass, "Relation", "id", "version", "timestamp", "changeset", "uid", "user", "tags", "members", NULL);
+
+  lazy_entities_class = rb_define_class_under(klass, "LazyEntities", rb_cObject);
+  rb_include_module(lazy_entities_class, rb_mEnumerable);
+  rb_undef_alloc_func(lazy_entities_class);
+  rb_define_method(lazy_entities_class, "size", lazy_entities_size, 0);
+  rb_define_method(lazy_entities_class, "length", lazy_entities_size, 0);
+  rb_define_method(lazy_entities_class, "empty?", lazy_entities_empty, 0);
+  rb_define_method(lazy_entities_class, "[]", lazy_entities_aref, 1);
+  rb_define_method(lazy_entities_class, "each", lazy_entities_each, 0);
+  rb_define_method(lazy_entities_class, "inspect", lazy_entities_inspect, 0);
+
+  lazy_entity_class = rb_define_class_under(klass, "LazyEntity", rb_cObject);
+  rb_undef_alloc_func(lazy_entity_class);
+  rb_define_method(lazy_entity_class, "type", lazy_entity_type, 0);
+  rb_define_method(lazy_entity_class, "id", lazy_entity_id, 0);
+  rb_define_method(lazy_entity_class, "lat", lazy_entity_lat, 0);
+  rb_define_method(lazy_entity_class, "lon", lazy_entity_lon, 0);
+  rb_define_method(lazy_entity_class, "version", lazy_entity_version, 0);
+  rb_define_method(lazy_entity_class, "timestamp", lazy_entity_timestamp, 0);
+  rb_define_method(lazy_entity_class, "changeset", lazy_entity_changeset, 0);
+  rb_define_method(lazy_entity_class, "uid", lazy_entity_uid, 0);
+  rb_define_method(lazy_entity_class, "user", lazy_entity_user, 0);
+  rb_define_method(lazy_entity_class, "tags", lazy_entity_tags, 0);
+  rb_define_method(lazy_entity_class, "tag", lazy_entity_tag, 1);
+  rb_define_method(lazy_entity_class, "refs", lazy_entity_refs, 0);
+  rb_define_method(lazy_entity_class, "members", lazy_entity_members, 0);
+  rb_define_method(lazy_entity_class, "[]", lazy_entity_aref, 1);
+  rb_define_method(lazy_entity_class, "to_h", lazy_entity_to_h, 0);
+  rb_define_method(lazy_entity_class, "inspect", lazy_entity_inspect, 0);
 }
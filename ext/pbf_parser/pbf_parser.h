@@ -3,24 +3,414 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
 #include <ruby.h>
 
 #ifdef HAVE_RUBY_ENCODING_H
 #include <ruby/encoding.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PREAD) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+#define PBF_USE_THREADS
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
 #include "zlib.h"
 
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
 #include "fileformat.pb-c.h"
 #include "osmformat.pb-c.h"
 
 #define MAX_BLOB_HEADER_SIZE 64 * 1024
 #define MAX_BLOB_SIZE 32 * 1024 * 1024
 
+#define ARENA_CHUNK_SIZE 1024 * 1024
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+#define INDEX_MAGIC "PBFIDX\n"
+#define INDEX_VERSION 2
+
+// Members of PbfParser::Node, see entity_set
+#define NODE_ID 0
+#define NODE_LAT 1
+#define NODE_LON 2
+#define NODE_INFO 3 // version, timestamp, changeset, uid and user
+#define NODE_TAGS 8
+
+// Members of PbfParser::Way and PbfParser::Relation
+#define ENTITY_ID 0
+#define ENTITY_INFO 1
+#define ENTITY_TAGS 6
+#define ENTITY_REFS 7
+#define ENTITY_MEMBERS 7
+
+#define STRING_CACHE_SIZE 8192
+#define STRING_CACHE_NONE UINT32_MAX
+
 #define NANO_DEGREE .000000001
 
 #define STR2SYM(str) ID2SYM(rb_intern(str))
-#define FIX7(num)    rb_funcall(num, rb_intern("round"), 1, INT2NUM(7))
+
+// Growable buffer, reused from one blob to the next
+typedef struct {
+  void *data;
+  size_t size;
+} pbf_buffer_t;
+
+/*
+  Input backend. When the file is memory-mapped `map` points to its contents
+  and reads hand out pointers into the mapping, otherwise reads go through
+  `file` into a caller supplied buffer.
+*/
+typedef struct {
+  FILE *file;
+  char *map;
+  size_t map_size;
+  size_t map_pos;
+} pbf_input_t;
+
+typedef struct pbf_arena_chunk {
+  struct pbf_arena_chunk *next;
+  size_t size;
+  size_t used;
+} pbf_arena_chunk_t;
+
+/*
+  Bump-pointer allocator handed to protobuf-c. Everything unpacked while
+  decoding a block is released at once by arena_reset.
+*/
+typedef struct {
+  ProtobufCAllocator allocator;
+  pbf_arena_chunk_t *chunks;
+  size_t used;
+  size_t peak;
+  size_t capacity;
+} pbf_arena_t;
+
+// State needed to turn a blob into an unpacked block
+typedef struct {
+  VALUE *error_class;
+  const char *error;
+  pbf_buffer_t compressed;
+  pbf_buffer_t raw;
+  pbf_arena_t arena;
+  // BlobHeader and Blob, kept out of `arena` and reset as each of them is read
+  pbf_arena_t scratch;
+  z_stream strm;
+  int strm_ready;
+#ifdef HAVE_LIBDEFLATE
+  struct libdeflate_decompressor *deflate;
+#endif
+#ifdef HAVE_LZMA
+  lzma_stream lzma;
+  int lzma_ready;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DCtx *zstd;
+#endif
+} pbf_decoder_t;
+
+// pbf_blob_info_t flags
+#define BLOB_INDEXED       1
+#define BLOB_HAS_NODES     2
+#define BLOB_HAS_WAYS      4
+#define BLOB_HAS_RELATIONS 8
+#define BLOB_ALL_TYPES     (BLOB_HAS_NODES | BLOB_HAS_WAYS | BLOB_HAS_RELATIONS)
+
+// Entity fields to convert, see the fields: option
+#define FIELD_ID        1
+#define FIELD_LAT       2
+#define FIELD_LON       4
+#define FIELD_VERSION   8
+#define FIELD_TIMESTAMP 16
+#define FIELD_CHANGESET 32
+#define FIELD_UID       64
+#define FIELD_USER      128
+#define FIELD_TAGS      256
+#define FIELD_REFS      512
+#define FIELD_MEMBERS   1024
+#define FIELD_INFO      (FIELD_VERSION | FIELD_TIMESTAMP | FIELD_CHANGESET | FIELD_UID | FIELD_USER)
+#define FIELD_ALL       2047
+
+// Smallest and largest value seen, min > max if there was none
+typedef struct {
+  int64_t min;
+  int64_t max;
+} pbf_range_t;
+
+/*
+  Position of an OSMData blob, as found by find_all_blobs. What the block
+  contains takes decoding it, so the rest is only filled in by #build_index,
+  which sets BLOB_INDEXED.
+*/
+typedef struct {
+  long header_pos;
+  long header_size;
+  long data_pos;
+  size_t data_size;
+  uint32_t flags;
+  pbf_range_t node_ids;
+  pbf_range_t way_ids;
+  pbf_range_t relation_ids;
+  pbf_range_t lat;       // nanodegrees
+  pbf_range_t lon;
+  pbf_range_t timestamp; // same unit as the entities' :timestamp
+} pbf_blob_info_t;
+
+/*
+  Header of the sidecar blob index, followed by `n_blobs` pbf_blob_info_t. The
+  index is only reused while size, mtime and OSMHeader checksum match the file.
+  It is written in native byte order, `entry_size` and `magic` catch indexes
+  written by a different build.
+*/
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t file_size;
+  int64_t file_mtime;
+  uint64_t header_checksum;
+  uint64_t n_blobs;
+} pbf_index_header_t;
+
+/*
+  Blob list of a parser, either scanned from the file into malloc'd memory or
+  pointing into a sidecar index mapped from disk.
+*/
+typedef struct {
+  char *path;
+  pbf_index_header_t key;
+  pbf_blob_info_t *blobs;
+  size_t n_blobs;
+  int loaded;
+  void *map;
+  size_t map_size;
+} pbf_index_t;
+
+/*
+  State shared between a decoding step running without the GVL and the
+  unblocking function, which asks it to stop between two stages.
+*/
+typedef struct {
+  void *(*func)(void *);
+  pbf_input_t *input;
+  pbf_decoder_t *decoder;
+  OSMPBF__PrimitiveBlock *block;
+  pbf_blob_info_t *blobs;
+  size_t n_blobs;
+  volatile int interrupted;
+  // Set once `func` has run, it doesn't if an interrupt was already pending
+  int finished;
+} pbf_step_t;
+
+// Called on each block a binary search decodes, see search_sorted
+typedef struct {
+  void (*func)(void *arg, size_t blob, OSMPBF__PrimitiveBlock *block);
+  void *arg;
+} pbf_probe_t;
+
+// Running values while walking the delta coded DenseNodes, see dense_next
+typedef struct {
+  size_t i;
+  int64_t id;
+  int64_t lat;
+  int64_t lon;
+  int32_t version;
+  int64_t timestamp;
+  int64_t changeset;
+  int32_t user_sid;
+  int32_t uid;
+  size_t tags;
+  size_t next_tags;
+} pbf_dense_cursor_t;
+
+// Units of node coordinates, see the coordinates: option
+#define COORDINATES_DEGREES     0
+#define COORDINATES_NANODEGREES 1
+#define COORDINATES_E7          2
+
+// String cache entry, chained in its hash bucket and in LRU order
+typedef struct {
+  uint64_t hash;
+  VALUE string;
+  uint32_t next;
+  uint32_t newer;
+  uint32_t older;
+} pbf_string_entry_t;
+
+/*
+  Strings from the string tables, kept from one block to the next so common
+  tags aren't created again for every block. Holds at most `capacity` strings
+  and drops the least recently used one when full. Entries refer to each other
+  by index, STRING_CACHE_NONE standing for none.
+*/
+typedef struct {
+  pbf_string_entry_t *entries;
+  uint32_t *buckets;
+  size_t n_buckets;
+  size_t capacity;
+  size_t size;
+  uint32_t newest;
+  uint32_t oldest;
+  size_t hits;
+  size_t misses;
+} pbf_string_cache_t;
+
+// IDs behind a PbfParser::PackedIds
+typedef struct {
+  long size;
+  int64_t ids[];
+} pbf_packed_ids_t;
+
+// What is needed to convert the entities of a block, see convert_init
+typedef struct {
+  OSMPBF__StringTable *string_table;
+  int64_t lat_offset;
+  int64_t lon_offset;
+  int64_t granularity;
+  int32_t ts_granularity;
+  int node_fields;
+  int way_fields;
+  int relation_fields;
+  int coordinates;
+  int packed;
+  int structs;
+  VALUE strings; // string table entries converted so far, see string_table_get
+  pbf_string_cache_t *cache;
+} pbf_convert_t;
+
+// Node of a lazy block, either a plain one or the dense one `cursor` is on
+typedef struct {
+  OSMPBF__Node *node;
+  OSMPBF__DenseNodes *dense;
+  pbf_dense_cursor_t cursor;
+} pbf_lazy_node_t;
+
+/*
+  Unpacked block behind the entities of the lazy: option. It owns the arena
+  the block was unpacked into, and lists its entities the first time they are
+  asked for, see lazy_block_index.
+*/
+typedef struct {
+  pbf_arena_t arena;
+  OSMPBF__PrimitiveBlock *block;
+  pbf_convert_t convert;
+  VALUE parser;
+  int types;
+  int indexed;
+  pbf_lazy_node_t *nodes;
+  size_t n_nodes;
+  OSMPBF__Way **ways;
+  size_t n_ways;
+  OSMPBF__Relation **relations;
+  size_t n_relations;
+} pbf_lazy_block_t;
+
+// PbfParser::LazyEntities of `type` in a lazy block, or its entity `index` for a PbfParser::LazyEntity
+typedef struct {
+  VALUE block;
+  int type;
+  size_t index;
+} pbf_lazy_ref_t;
+
+#ifdef PBF_USE_THREADS
+// A blob to decode, as located by find_all_blobs
+typedef struct {
+  long data_pos;
+  size_t data_size;
+  long blob;
+  pbf_blob_info_t *info; // summary of the block goes here if set
+} pbf_job_t;
+
+typedef struct {
+  pbf_decoder_t decoder;
+  OSMPBF__PrimitiveBlock *block;
+  int done;
+} pbf_slot_t;
+
+/*
+  Worker threads decode jobs into a ring of slots, job i going to slot
+  i % n_slots, and the Ruby thread takes them back in job order. Workers never
+  run more than n_slots jobs ahead of the consumer, which bounds memory.
+*/
+typedef struct {
+  pbf_input_t *input;
+  pbf_job_t *jobs;
+  size_t n_jobs;
+  size_t next_job;
+  size_t next_result;
+  pbf_slot_t *slots;
+  size_t n_slots;
+  pthread_t *threads;
+  int n_threads;
+  int stop;
+  int interrupted;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} pbf_pipeline_t;
+#endif
+
+typedef struct {
+  pbf_input_t input;
+  pbf_decoder_t decoder;
+  pbf_index_t index;
+  int busy;
+  // File offset of the block at @pos, to read it again without the index
+  long block_pos;
+  // Entity types converted unless asked otherwise, as BLOB_HAS_* flags
+  int types;
+  // Fields converted for each entity type, as FIELD_* flags
+  int node_fields;
+  int way_fields;
+  int relation_fields;
+  // COORDINATES_* unit of node lat/lon
+  int coordinates;
+  // Nodes go to packed columns instead of hashes, see nodes_columns_new
+  int node_columns;
+  // Way refs and relation members are packed, see packed_members_new
+  int packed;
+  // Entities are read from the unpacked block when asked for, see lazy_block_new
+  int lazy;
+  // Entities are PbfParser::Node, Way and Relation structs instead of hashes
+  int structs;
+  pbf_string_cache_t strings;
+  // Types each blob may hold, if the index or the sort order tell, see get_blob_types
+  unsigned char *blob_types;
+  int blob_types_ready;
+#ifdef PBF_USE_THREADS
+  // Blocks decoded ahead of #next on a background thread, for `read_ahead_types`
+  int read_ahead;
+  int read_ahead_types;
+  pbf_pipeline_t pipeline;
+#endif
+} pbf_parser_t;
 
 void Init_pbf_parser(void);
 